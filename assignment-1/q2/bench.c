@@ -0,0 +1,289 @@
+#include "./utils.h"
+#include <sys/time.h>
+
+#define BENCH_DATA_FILE "bench_data"
+#define BENCH_NODES_WAIT 15 // seconds to wait for the nodes to show up
+
+// a command every session runs over and over, and the size of its output
+struct scenario
+{
+  char *name;
+  char cmd[MAX_COMMAND_SIZE];
+  size_t expected;
+};
+
+// a connection to the server running a scenario, and what it measured
+struct session
+{
+  int fd;
+  struct scenario *sc;
+  long long until;
+  long long *latencies; // microseconds
+  int count;
+  int cap;
+  size_t bytes;
+  int errors;
+};
+
+/**
+ * @brief Microseconds of a monotonic clock
+ * 
+ * @return long long 
+ */
+long long nowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Connect to the server from the given local IP, so that the
+ * session is not taken for a node, and register it
+ * 
+ * @param server_ip 
+ * @param server_port 
+ * @param local_ip 
+ * @return int socket fd
+ */
+int connectSession(char *server_ip, int server_port, char *local_ip)
+{
+  struct sockaddr_in laddr, saddr;
+  memset(&laddr, 0, sizeof(laddr));
+  laddr.sin_family = AF_INET;
+  laddr.sin_addr.s_addr = inet_addr(local_ip);
+  memset(&saddr, 0, sizeof(saddr));
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(server_port);
+  saddr.sin_addr.s_addr = inet_addr(server_ip);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd != -1, "socket creation error", -1, -1);
+  assert(bind(fd, (struct sockaddr *)&laddr, sizeof(laddr)) == 0, "could not bind the session to its local IP", fd, -1);
+  assert(connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) == 0, "could not connect to the server", fd, -1);
+
+  // the session runs no commands itself, nothing listens on its port
+  write(fd, "1\n", 2);
+  return fd;
+}
+
+/**
+ * @brief Send a command and read its output up to the terminating null
+ * character
+ * 
+ * @param fd 
+ * @param cmd 
+ * @param out if not NULL, the output is collected in it
+ * @return long long number of bytes of output, -1 if the server went away
+ */
+long long runCommand(int fd, char *cmd, struct buffer *out)
+{
+  if (writeAll(fd, cmd, strlen(cmd)) == -1)
+    return -1;
+
+  char buff[PUMP_CHUNK_SIZE];
+  long long total = 0;
+  for (;;)
+  {
+    ssize_t n = read(fd, buff, sizeof(buff));
+    if (n <= 0)
+      return -1;
+    char *nul = memchr(buff, '\0', n);
+    size_t len = nul ? (size_t)(nul - buff) : (size_t)n;
+    if (out)
+      bufferAppend(out, buff, len);
+    total += len;
+    if (nul)
+      return total;
+  }
+}
+
+/**
+ * @brief Wait until the server lists the given number of live nodes. The
+ * sessions themselves count as machines until they miss their heartbeats.
+ * 
+ * @param fd 
+ * @param nodes 
+ * @return true 
+ * @return false if the nodes did not show up in time
+ */
+bool waitForNodes(int fd, int nodes)
+{
+  for (int i = 0; i < BENCH_NODES_WAIT * 2; i++)
+  {
+    struct buffer out;
+    bufferInit(&out);
+    if (runCommand(fd, "nodes", &out) == -1)
+      return false;
+    int live = 0;
+    for (size_t j = 0; j < out.len; j++)
+      live += out.data[j] == '\n';
+    bufferFree(&out);
+    if (live == nodes)
+      return true;
+    usleep(500000);
+  }
+  return false;
+}
+
+/**
+ * @brief Run the scenario of a session until its time is up
+ * 
+ * @param args session 
+ * @return void* 
+ */
+void *sessionHandler(void *args)
+{
+  struct session *s = (struct session *)args;
+  while (nowUs() < s->until)
+  {
+    long long start = nowUs();
+    long long n = runCommand(s->fd, s->sc->cmd, NULL);
+    if (n == -1)
+    {
+      s->errors++;
+      break;
+    }
+    if (s->count == s->cap)
+    {
+      s->cap = s->cap ? 2 * s->cap : 1024;
+      s->latencies = (long long *)realloc(s->latencies, s->cap * sizeof(long long));
+      assert(s->latencies != NULL, "realloc error for latencies", s->fd, -1);
+    }
+    s->latencies[s->count++] = nowUs() - start;
+    s->bytes += n;
+    s->errors += (size_t)n != s->sc->expected;
+  }
+  return NULL;
+}
+
+int compareLatencies(const void *a, const void *b)
+{
+  long long x = *(long long *)a, y = *(long long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Latency of the given percentile, in milliseconds
+ * 
+ * @param sorted 
+ * @param count 
+ * @param percent 
+ * @return double 
+ */
+double percentile(long long *sorted, int count, double percent)
+{
+  if (count == 0)
+    return 0;
+  int rank = (int)ceil(percent / 100 * count) - 1;
+  return sorted[rank < 0 ? 0 : rank] / 1000.0;
+}
+
+/**
+ * @brief Run a scenario on every session at the same time and print its
+ * throughput and latencies
+ * 
+ * @param sc 
+ * @param sessions 
+ * @param count number of sessions
+ * @param seconds 
+ */
+void runScenario(struct scenario *sc, struct session *sessions, int count, int seconds)
+{
+  pthread_t threads[count];
+  long long start = nowUs();
+  for (int i = 0; i < count; i++)
+  {
+    sessions[i].sc = sc;
+    sessions[i].until = start + (long long)seconds * 1000000;
+    sessions[i].count = 0;
+    sessions[i].bytes = 0;
+    sessions[i].errors = 0;
+    assert(pthread_create(&threads[i], NULL, sessionHandler, &sessions[i]) == 0, "pthread_create error", -1, -1);
+  }
+
+  int total = 0, errors = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < count; i++)
+  {
+    pthread_join(threads[i], NULL);
+    total += sessions[i].count;
+    errors += sessions[i].errors;
+    bytes += sessions[i].bytes;
+  }
+  double elapsed = (nowUs() - start) / 1000000.0;
+
+  long long *all = (long long *)malloc((total ? total : 1) * sizeof(long long));
+  assert(all != NULL, "malloc error for latencies", -1, -1);
+  int n = 0;
+  for (int i = 0; i < count; i++)
+  {
+    memcpy(all + n, sessions[i].latencies, sessions[i].count * sizeof(long long));
+    n += sessions[i].count;
+  }
+  qsort(all, total, sizeof(long long), compareLatencies);
+
+  printf("%-10s %7d %9.1f %9.2f %8.2f %8.2f %8.2f %8.2f %7d\n", sc->name, total, total / elapsed, bytes / elapsed / (1024 * 1024),
+         percentile(all, total, 50), percentile(all, total, 90), percentile(all, total, 99), percentile(all, total, 100), errors);
+  fflush(stdout);
+  free(all);
+}
+
+/**
+ * @brief Write the file the scenarios read on the nodes: lines of text of
+ * the given total size
+ * 
+ * @param size 
+ */
+void writeBenchData(size_t size)
+{
+  FILE *f = fopen(BENCH_DATA_FILE, "w");
+  assert(f != NULL, "could not create " BENCH_DATA_FILE, -1, -1);
+  for (size_t i = 0; i < size; i++)
+    fputc(i % 64 == 63 ? '\n' : 'a' + i % 26, f);
+  fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 5 || argc > 8)
+  {
+    errExit("\nUsage: bench.out <SERVER_IP> <SERVER_PORT> <SESSION_IP> <NODES> [SESSIONS] [OUTPUT_SIZE] [SECONDS]\n", -1, -1);
+  }
+  int nodes = atoi(argv[4]);
+  int count = argc > 5 ? atoi(argv[5]) : 2;
+  size_t size = argc > 6 ? strtoul(argv[6], NULL, 10) : 65536;
+  int seconds = argc > 7 ? atoi(argv[7]) : 5;
+  assert(nodes > 0 && count > 0 && seconds > 0, "NODES, SESSIONS and SECONDS should be positive numbers", -1, -1);
+  signal(SIGPIPE, SIG_IGN);
+
+  // the nodes are started in the directory the benchmark runs in
+  writeBenchData(size);
+
+  struct session sessions[count];
+  memset(sessions, 0, sizeof(sessions));
+  for (int i = 0; i < count; i++)
+    sessions[i].fd = connectSession(argv[1], atoi(argv[2]), argv[3]);
+  assert(waitForNodes(sessions[0].fd, nodes), "the nodes did not show up, check the config file", sessions[0].fd, -1);
+
+  struct scenario scenarios[3] = {{.name = "single"}, {.name = "broadcast"}, {.name = "pipeline"}};
+  sprintf(scenarios[0].cmd, "n1.cat %s", BENCH_DATA_FILE);
+  scenarios[0].expected = size;
+  sprintf(scenarios[1].cmd, "n*.cat %s", BENCH_DATA_FILE);
+  scenarios[1].expected = nodes * size;
+  sprintf(scenarios[2].cmd, "n1.cat %s | n%d.cat | n%d.cat", BENCH_DATA_FILE, 2 % nodes + 1, 3 % nodes + 1);
+  scenarios[2].expected = size;
+
+  printf("%d nodes, %d sessions, %zu bytes of output per node, %ds per scenario\n", nodes, count, size, seconds);
+  printf("%-10s %7s %9s %9s %8s %8s %8s %8s %7s\n", "scenario", "cmds", "cmds/s", "MB/s", "p50ms", "p90ms", "p99ms", "maxms", "errors");
+  for (int i = 0; i < 3; i++)
+    runScenario(&scenarios[i], sessions, count, seconds);
+
+  for (int i = 0; i < count; i++)
+  {
+    close(sessions[i].fd);
+    free(sessions[i].latencies);
+  }
+  unlink(BENCH_DATA_FILE);
+  return 0;
+}
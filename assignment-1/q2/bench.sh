@@ -0,0 +1,54 @@
+#!/bin/sh
+# Start a clustershell server and NODES clustershell clients on loopback in
+# a scratch directory, and run bench.out against them.
+# All loopback connections come from 127.0.0.1, so the nodes share that IP
+# and are told apart by their port. The benchmark sessions connect from
+# 127.0.0.2 and get config entries of their own.
+
+NODES=${NODES:-4}
+SESSIONS=${SESSIONS:-2}
+SIZE=${SIZE:-65536}
+SECONDS_EACH=${SECONDS_EACH:-5}
+PORT=${PORT:-9500}
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d /tmp/clustershell_bench_XXXXXX)
+cd "$DIR" || exit 1
+
+i=1
+while [ $i -le "$NODES" ]; do
+  echo "n$i 127.0.0.1" >>config.txt
+  i=$((i + 1))
+done
+i=1
+while [ $i -le "$SESSIONS" ]; do
+  echo "n$((NODES + i)) 127.0.0.2" >>config.txt
+  i=$((i + 1))
+done
+
+# the shells of the clients wait on a fifo that never gets a command
+mkfifo stdin
+exec 3<>stdin
+
+"$BIN/server.out" "$PORT" >server.log 2>&1 &
+PIDS=$!
+sleep 0.5
+i=1
+while [ $i -le "$NODES" ]; do
+  "$BIN/client.out" 127.0.0.1 "$PORT" $((PORT + i)) <stdin >client$i.log 2>&1 &
+  PIDS="$PIDS $!"
+  sleep 0.2
+  i=$((i + 1))
+done
+
+"$BIN/bench.out" 127.0.0.1 "$PORT" 127.0.0.2 "$NODES" "$SESSIONS" "$SIZE" "$SECONDS_EACH"
+STATUS=$?
+
+# the daemon of a client is a child of its shell process, it goes first
+# (SIGUSR1 lets it remove its Unix socket)
+for pid in $PIDS; do
+  pkill -USR1 -P "$pid" 2>/dev/null
+  kill "$pid" 2>/dev/null
+done
+cd / && rm -rf "$DIR"
+exit $STATUS
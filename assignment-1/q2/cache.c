@@ -0,0 +1,259 @@
+#include "cache.h"
+
+// the cache is shared by all clients of the server
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Go on with a 64 bit FNV-1a hash over more data
+ * 
+ * @param hash hash of the data so far
+ * @param data 
+ * @param len 
+ * @return uint64_t 
+ */
+static uint64_t hashMore(uint64_t hash, const char *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+  return hash;
+}
+
+/**
+ * @brief 64 bit FNV-1a hash of the data
+ * 
+ * @param data 
+ * @param len 
+ * @return uint64_t 
+ */
+uint64_t cacheHash(const char *data, size_t len)
+{
+  return hashMore(14695981039346656037ull, data, len);
+}
+
+/**
+ * @brief Hash of the parts of the list, the same as cacheHash of all of
+ * them put together
+ * 
+ * @param list 
+ * @return uint64_t 
+ */
+uint64_t cacheHashList(struct buffer_list *list)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < list->count; i++)
+    hash = hashMore(hash, list->parts[i].data.data, list->parts[i].data.len);
+  return hash;
+}
+
+/**
+ * @brief Build the key of the hops: the node and command of every hop, and
+ * the deadline since a command that may be cut short gives other output
+ * 
+ * @param hops 
+ * @param count 
+ * @param key 
+ */
+static void cacheKey(struct hop *hops, int count, struct buffer *key)
+{
+  char line[MAX_COMMAND_SIZE + 64];
+  bufferInit(key);
+  for (int i = 0; i < count; i++)
+  {
+    char *cmd = hops[i].cmd;
+    while (*cmd == ' ')
+      cmd++;
+    snprintf(line, sizeof(line), "n%d %d %s\n", hops[i].node, hops[i].timeout_ms, cmd);
+    bufferAppend(key, line, strlen(line));
+  }
+}
+
+/**
+ * @brief Unlink and free the entry at *link. Must hold cache_lock.
+ * 
+ * @param link 
+ */
+static void removeEntry(struct cache_entry **link)
+{
+  struct cache_entry *entry = *link;
+  *link = entry->next;
+  stats.entries--;
+  stats.size -= entry->output.len;
+  free(entry->key);
+  bufferFree(&entry->output);
+  free(entry);
+}
+
+/**
+ * @brief Drop expired entries. Must hold cache_lock.
+ */
+static void removeExpired()
+{
+  long long now = nowMs();
+  for (int i = 0; i < CACHE_BUCKETS; i++)
+  {
+    struct cache_entry **link = &buckets[i];
+    while (*link)
+    {
+      if ((*link)->expires <= now)
+      {
+        removeEntry(link);
+        stats.evictions++;
+      }
+      else
+        link = &(*link)->next;
+    }
+  }
+}
+
+/**
+ * @brief Find the entry of the key and input. Must hold cache_lock.
+ * 
+ * @param key 
+ * @param input_hash 
+ * @param hash hash of the key
+ * @return struct cache_entry** link to the entry, or to the end of its bucket
+ */
+static struct cache_entry **findEntry(char *key, uint64_t input_hash, uint64_t hash)
+{
+  struct cache_entry **link = &buckets[hash % CACHE_BUCKETS];
+  while (*link && ((*link)->input_hash != input_hash || strcmp((*link)->key, key) != 0))
+    link = &(*link)->next;
+  return link;
+}
+
+/**
+ * @brief Look up the output of running the hops on the input. A hit copies
+ * the output into output.
+ * 
+ * @param hops 
+ * @param count 
+ * @param input 
+ * @param output 
+ * @return true on a hit
+ * @return false 
+ */
+bool cacheLookup(struct hop *hops, int count, struct buffer_list *input, struct buffer *output)
+{
+  struct buffer key;
+  cacheKey(hops, count, &key);
+  uint64_t input_hash = cacheHashList(input);
+  uint64_t hash = cacheHash(key.data, key.len);
+
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry **link = findEntry(key.data, input_hash, hash);
+  if (*link && (*link)->expires <= nowMs())
+  {
+    removeEntry(link);
+    stats.evictions++;
+  }
+  bool hit = *link != NULL;
+  if (hit)
+  {
+    stats.hits++;
+    bufferAppend(output, (*link)->output.data ? (*link)->output.data : "", (*link)->output.len);
+  }
+  else
+    stats.misses++;
+  pthread_mutex_unlock(&cache_lock);
+
+  bufferFree(&key);
+  return hit;
+}
+
+/**
+ * @brief Store the output of running the hops on the input, for ttl_ms.
+ * Outputs too large for the cache are not stored.
+ * 
+ * @param hops 
+ * @param count 
+ * @param input 
+ * @param output 
+ * @param ttl_ms 
+ */
+void cacheStore(struct hop *hops, int count, struct buffer_list *input, struct buffer *output, int ttl_ms)
+{
+  if (output->len > CACHE_MAX_ENTRY_SIZE || count > MAX_HOPS)
+    return;
+
+  struct cache_entry *entry = (struct cache_entry *)calloc(1, sizeof(struct cache_entry));
+  assert(entry != NULL, "calloc error while caching output", -1, -1);
+  struct buffer key;
+  cacheKey(hops, count, &key);
+  entry->key = key.data;
+  entry->input_hash = cacheHashList(input);
+  entry->node_count = count;
+  for (int i = 0; i < count; i++)
+    entry->nodes[i] = hops[i].node;
+  bufferInit(&entry->output);
+  bufferAppend(&entry->output, output->data ? output->data : "", output->len);
+  entry->expires = nowMs() + ttl_ms;
+  uint64_t hash = cacheHash(key.data, key.len);
+
+  pthread_mutex_lock(&cache_lock);
+  if (stats.size + output->len > CACHE_MAX_SIZE)
+    removeExpired();
+  if (stats.size + output->len > CACHE_MAX_SIZE)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    free(entry->key);
+    bufferFree(&entry->output);
+    free(entry);
+    return;
+  }
+
+  struct cache_entry **link = findEntry(entry->key, entry->input_hash, hash);
+  if (*link)
+    removeEntry(link); // replace an older result
+  entry->next = buckets[hash % CACHE_BUCKETS];
+  buckets[hash % CACHE_BUCKETS] = entry;
+  stats.entries++;
+  stats.stores++;
+  stats.size += output->len;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Drop the cached outputs involving the node, or all of them
+ * 
+ * @param node node number, 0 for all nodes
+ * @return int number of entries dropped
+ */
+int cacheInvalidate(int node)
+{
+  int dropped = 0;
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < CACHE_BUCKETS; i++)
+  {
+    struct cache_entry **link = &buckets[i];
+    while (*link)
+    {
+      bool match = node == 0;
+      for (int j = 0; j < (*link)->node_count && !match; j++)
+        match = (*link)->nodes[j] == node;
+      if (match)
+      {
+        removeEntry(link);
+        dropped++;
+      }
+      else
+        link = &(*link)->next;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return dropped;
+}
+
+/**
+ * @brief Get a copy of the cache counters
+ * 
+ * @param out 
+ */
+void cacheGetStats(struct cache_stats *out)
+{
+  pthread_mutex_lock(&cache_lock);
+  removeExpired();
+  *out = stats;
+  pthread_mutex_unlock(&cache_lock);
+}
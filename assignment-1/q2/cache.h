@@ -0,0 +1,46 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "utils.h"
+
+#define CACHE_BUCKETS 256
+#define CACHE_DEFAULT_TTL_MS 60000
+#define CACHE_MAX_ENTRY_SIZE (1024 * 1024) // larger results are not cached
+#define CACHE_MAX_SIZE (16 * 1024 * 1024)  // bytes of output held by the cache
+
+// cached output of a command (or chain of commands) run on some nodes.
+// The key names the nodes and commands, input_hash identifies the input.
+struct cache_entry
+{
+  char *key;
+  uint64_t input_hash;
+  int nodes[MAX_HOPS];
+  int node_count;
+  struct buffer output;
+  long long expires; // nowMs() based
+  struct cache_entry *next;
+};
+
+struct cache_stats
+{
+  long hits;
+  long misses;
+  long stores;
+  long evictions;
+  long entries;
+  size_t size;
+};
+
+uint64_t cacheHash(const char *data, size_t len);
+
+uint64_t cacheHashList(struct buffer_list *list);
+
+bool cacheLookup(struct hop *hops, int count, struct buffer_list *input, struct buffer *output);
+
+void cacheStore(struct hop *hops, int count, struct buffer_list *input, struct buffer *output, int ttl_ms);
+
+int cacheInvalidate(int node);
+
+void cacheGetStats(struct cache_stats *stats);
+
+#endif
@@ -9,16 +9,68 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <sys/time.h>
 #include "./utils.h"
 
+#define DEFAULT_MAX_RUNNING 8
+#define MAX_QUEUED 32
+#define BUSY_EXIT_CODE 75
+#define MAX_REJECTING 4        // busy workers at a time, requests past them are dropped
+#define HEADER_TIMEOUT_MS 2000 // time a sender has to send the header of its request
+
 // sfd1 is for client -> server connection (when clustershell_client acts as a client)
 // sfd2 is for when clustershell_client acts as a server
 int sfd1 = -1, sfd2 = -1;
 
+// Unix socket the daemon also listens on, for a server on the same host
+int sfd3 = -1;
+char unix_path[UNIX_PATH_SIZE];
+
+// a request accepted by the daemon that waits for its header or for a
+// free worker
+struct pending_request
+{
+  int cfd;
+  struct stage_request req;
+  int header_len;
+  long long deadline; // for the header to be in
+  struct pending_request *next;
+};
+
+// worker pool of the daemon: a worker process is forked per request, at
+// most max_running at a time, the rest wait in a bounded queue
+int max_running = DEFAULT_MAX_RUNNING;
+pid_t *workers;
+int running = 0, queued = 0;
+struct pending_request *queue_head = NULL, *queue_tail = NULL;
+
+// requests whose header is still coming in, read as it arrives so that a
+// slow sender does not hold up the daemon
+struct pending_request *reading_head = NULL;
+int reading = 0;
+
+// workers only telling a sender that this node is busy
+int rejecting = 0;
+
+// the SIGCHLD handler of the daemon writes to this pipe to wake it up
+int chld_pipe[2];
+
+// command run by a relay worker, killed by the SIGALRM handler once its
+// deadline passes
+pid_t relay_pid = -1;
+volatile sig_atomic_t relay_timed_out = 0;
+
 void cleanup()
 {
   close(sfd1);
   close(sfd2);
+  if (sfd3 != -1)
+  {
+    close(sfd3);
+    unlink(unix_path);
+  }
 }
 
 // If Ctrl+C is pressed, cleanup and terminate
@@ -40,6 +92,24 @@ void sigChldHandler(int sig_num)
   _exit(0);
 }
 
+// SIGCHLD handler for the daemon, a worker has finished
+void workerExitHandler(int sig_num)
+{
+  (void)sig_num;
+  int saved_errno = errno;
+  write(chld_pipe[1], "", 1);
+  errno = saved_errno;
+}
+
+// SIGALRM handler for a relay worker, the deadline of its command passed
+void relayDeadlineHandler(int sig_num)
+{
+  (void)sig_num;
+  if (relay_pid != -1)
+    killpg(relay_pid, SIGKILL);
+  relay_timed_out = 1;
+}
+
 // SIGUSR1 handler for child
 void sigUsrHandler(int sig_num)
 {
@@ -48,74 +118,569 @@ void sigUsrHandler(int sig_num)
   _exit(EXIT_FAILURE);
 }
 
-char *executeCmd(char *cmd)
+/**
+ * @brief Read and drop the input frames of a request
+ * 
+ * @param cfd 
+ */
+void drainInput(int cfd)
+{
+  struct pump p;
+  initPump(&p, cfd, -1, PUMP_KEEP);
+  p.mode = PUMP_DECODE;
+  p.end_frame = true;
+  runPumps(&p, 1, 0);
+}
+
+/**
+ * @brief Send the stderr and exit status of this node's command upstream.
+ * The status also reports how loaded the node is.
+ * 
+ * @param cfd 
+ * @param node 
+ * @param errs 
+ * @param exit_code 
+ * @param state ok, timeout, cancelled or busy
+ */
+void sendResult(int cfd, int node, struct buffer *errs, int exit_code, char *state)
+{
+  char status[96];
+  if (errs->len > 0)
+    writeFrames(cfd, FRAME_ERR, node, errs->data, errs->len);
+  sprintf(status, "exit=%d running=%d queued=%d state=%s", exit_code, running, queued, state);
+  writeFrames(cfd, FRAME_STATUS, node, status, strlen(status));
+}
+
+/**
+ * @brief Get the path of a change dir command
+ * 
+ * @param cmd 
+ * @return char* path, or NULL if cmd is not a change dir command
+ */
+char *changeDirPath(char *cmd)
+{
+  while (*cmd == ' ')
+    cmd++;
+  if (cmd[0] == 'c' && cmd[1] == 'd' && cmd[2] == ' ')
+    return cmd + 3;
+  return NULL;
+}
+
+/**
+ * @brief Start the command of a request. A change dir command has already
+ * been run by the daemon, since it has to change the directory of the
+ * daemon and not of the worker, so only its result is reported.
+ * 
+ * @param cmd 
+ * @param cd_status result of chdir if it is a change dir command
+ * @param in_fd 
+ * @param out_fd 
+ * @param err_fd 
+ * @param errs errors are added to it
+ * @param exit_code set if the command could not be run
+ * @return pid_t pid of the command, -1 if no command runs
+ */
+pid_t startCommand(char *cmd, int cd_status, int *in_fd, int *out_fd, int *err_fd, struct buffer *errs, int *exit_code)
+{
+  char buff[MAX_OUTPUT_SIZE + 1];
+  char *path;
+  pid_t pid = -1;
+  if ((path = changeDirPath(cmd)) != NULL)
+  { // if it is a change dir command
+    if (cd_status == -1)
+    {
+      sprintf(buff, "Error occurred while changing path to %s\n", path);
+      bufferAppend(errs, buff, strlen(buff));
+      *exit_code = 1;
+    }
+  }
+  else if ((pid = spawnCommand(cmd, in_fd, out_fd, err_fd)) == -1)
+  {
+    sprintf(buff, "Error occurred while running command %s\n", cmd);
+    bufferAppend(errs, buff, strlen(buff));
+    *exit_code = 127;
+  }
+  return pid;
+}
+
+/**
+ * @brief Serve a request from the clustershell_server or from the previous
+ * node of a chain. The request header names the command to run and the
+ * hops after this node. The input frames of the command follow the header
+ * on cfd. If there are hops after this node, the output of the command is
+ * streamed to the next node and whatever the next node sends back is
+ * relayed to cfd, otherwise the output is written to cfd directly. Either
+ * way this node's stderr and exit status are sent last.
+ * The command is killed when its deadline passes or the run is cancelled,
+ * ie. the upstream closes cfd or a peer stops taking the output. Closing
+ * the connection to the next node before its FRAME_END passes the
+ * cancellation down the chain.
+ * 
+ * @param cfd 
+ * @param req header of the request, already read from cfd
+ * @param cd_status result of chdir if it is a change dir command
+ */
+void handleRequest(int cfd, struct stage_request *req, int cd_status)
 {
   // remove leading spaces
+  char *cmd = req->cmd;
   while (*cmd == ' ')
     cmd++;
 
-  int len = strlen(cmd);
+  struct buffer errs;
+  bufferInit(&errs);
+  char buff[MAX_OUTPUT_SIZE + 1];
 
-  if (cmd[0] == 'c' && cmd[1] == 'd' && cmd[2] == ' ')
-  { // if it is a change dir command
-    char *path = cmd + 3;
+  // connect to the next node of the chain and pass the rest of the chain on
+  int next_fd = -1;
+  if (req->hop_count > 0)
+  {
+    struct hop *next = &req->hops[0];
+    next_fd = clientConnect(next->ip, next->port);
+    if (next_fd == -1 || writeRequestHeader(next_fd, req->hops, req->hop_count, NULL, 0, 0, req->zip) == -1)
+    {
+      sprintf(buff, "Could not forward command %s to machine n%d at %s:%d.\n", next->cmd, next->node, next->ip, next->port);
+      bufferAppend(&errs, buff, strlen(buff));
+      drainInput(cfd);
+      sendResult(cfd, req->node, &errs, 1, "ok");
+      bufferFree(&errs);
+      close(next_fd);
+      return;
+    }
+  }
+  int sink = next_fd != -1 ? next_fd : cfd;
+
+  struct pump pumps[4];
+  int count = 0;
+  pid_t pid = -1;
+  int in_fd = -1, out_fd = -1, err_fd = -1;
+  int exit_code = 0;
+
+  pid = startCommand(cmd, cd_status, &in_fd, &out_fd, &err_fd, &errs, &exit_code);
+
+  // feed the input to the command, the input is dropped if no command runs
+  // (afterwards cfd is watched, the upstream closing it cancels the command)
+  initPump(&pumps[count], cfd, in_fd, in_fd != -1 ? PUMP_CLOSE : PUMP_KEEP);
+  pumps[count].mode = PUMP_DECODE;
+  pumps[count].end_frame = true;
+  pumps[count].watch_eof = true;
+  pumps[count++].abort_on = PUMP_ABORT_READ;
+
+  // stream the output (empty if no command runs) to the next node or back
+  initPump(&pumps[count], out_fd, sink, PUMP_KEEP);
+  pumps[count].mode = PUMP_ENCODE;
+  pumps[count].frame_node = req->node;
+  pumps[count].end_frame = next_fd != -1;
+  pumps[count].compress = req->zip;
+  pumps[count++].abort_on = PUMP_ABORT_WRITE;
+
+  // collect stderr, it is sent after the output
+  if (err_fd != -1)
+  {
+    initPump(&pumps[count], err_fd, -1, PUMP_KEEP);
+    pumps[count].dst = &errs;
+    pumps[count++].dst_limit = MAX_STDERR_SIZE;
+  }
+
+  // relay the frames of the rest of the chain back
+  if (next_fd != -1)
+  {
+    initPump(&pumps[count], next_fd, cfd, PUMP_KEEP);
+    pumps[count++].abort_on = PUMP_ABORT_WRITE;
+  }
+
+  long long deadline = req->timeout_ms > 0 ? nowMs() + req->timeout_ms : 0;
+  int result = runPumps(pumps, count, deadline);
+  char *state = "ok";
+  if (result == PUMPS_TIMEOUT || result == PUMPS_ABORTED)
+  {
+    state = result == PUMPS_TIMEOUT ? "timeout" : "cancelled";
+    if (pid != -1)
+      killpg(pid, SIGKILL);
+    if (next_fd != -1)
+      shutdown(next_fd, SHUT_RDWR); // cut the stream short, the next node cancels too
+  }
+
+  if (pid != -1)
+  {
+    int status;
+    close(out_fd);
+    close(err_fd);
+    waitpid(pid, &status, 0);
+    exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+  if (next_fd != -1)
+    close(next_fd);
+
+  sendResult(cfd, req->node, &errs, exit_code, state);
+  bufferFree(&errs);
+}
+
+/**
+ * @brief Serve a broadcast sent down a relay tree. The command is run here
+ * and the request is forwarded to fanout nodes of the subtree, each of them
+ * getting its share of the rest of the subtree to relay to in turn, so a
+ * broadcast reaches N nodes in O(log N) steps. The input goes to all of
+ * them, so it is read in full first. The replies of the children are frame
+ * streams already tagged with their nodes; they are gathered and sent
+ * upstream after this node's own output, followed by its stderr and exit
+ * status.
+ * 
+ * @param cfd 
+ * @param req header of the request, already read from cfd
+ * @param cd_status result of chdir if it is a change dir command
+ */
+void handleRelay(int cfd, struct stage_request *req, int cd_status)
+{
+  // remove leading spaces
+  char *cmd = req->cmd;
+  while (*cmd == ' ')
+    cmd++;
 
-    // change directory
-    if (chdir(path) == -1)
+  struct buffer input, own, errs;
+  bufferInit(&input);
+  bufferInit(&own);
+  bufferInit(&errs);
+  char buff[MAX_OUTPUT_SIZE + 1];
+
+  struct pump p;
+  initPump(&p, cfd, -1, PUMP_KEEP);
+  p.dst = &input;
+  p.mode = PUMP_DECODE;
+  p.end_frame = true;
+  if (runPumps(&p, 1, 0) != PUMPS_OK)
+  { // cancelled before the input was complete
+    bufferFree(&input);
+    return;
+  }
+
+  int fanout = req->fanout < req->relay_count ? req->fanout : req->relay_count;
+  int child_fds[fanout];
+  struct buffer replies[fanout];
+  struct pump pumps[2 * fanout + 4];
+  int count = 0;
+
+  for (int i = 0; i < fanout; i++)
+  {
+    int start = i * req->relay_count / fanout;
+    int end = (i + 1) * req->relay_count / fanout;
+    struct hop child = req->relays[start];
+    child.cmd = req->cmd;
+    child.timeout_ms = req->timeout_ms;
+    bufferInit(&replies[i]);
+
+    child_fds[i] = clientConnect(child.ip, child.port);
+    if (child_fds[i] == -1 || writeRequestHeader(child_fds[i], &child, 1, req->relays + start + 1, end - start - 1, req->fanout, req->zip) == -1)
     {
-      char *buff = (char *)calloc(MAX_OUTPUT_SIZE + 1, sizeof(char));
-      sprintf(buff, "Error occurred while changing path to %s", path);
-      return buff;
+      // answer for the child, its subtree is left without a status
+      sprintf(buff, "Could not relay command %s to machine n%d at %s:%d.\n", cmd, child.node, child.ip, child.port);
+      appendFrames(&replies[i], FRAME_ERR, child.node, buff, strlen(buff));
+      sprintf(buff, "exit=1 running=0 queued=0 state=ok");
+      appendFrames(&replies[i], FRAME_STATUS, child.node, buff, strlen(buff));
+      if (child_fds[i] != -1)
+        close(child_fds[i]);
+      child_fds[i] = -1;
+      continue;
     }
+
+    initPump(&pumps[count], -1, child_fds[i], PUMP_KEEP);
+    pumps[count].src = &input;
+    pumps[count].mode = PUMP_ENCODE;
+    pumps[count].frame_node = child.node;
+    pumps[count].compress = req->zip;
+    pumps[count++].end_frame = true;
+    initPump(&pumps[count], child_fds[i], -1, PUMP_KEEP);
+    pumps[count++].dst = &replies[i];
   }
-  else
+
+  int in_fd = -1, out_fd = -1, err_fd = -1;
+  int exit_code = 0;
+  pid_t pid = startCommand(cmd, cd_status, &in_fd, &out_fd, &err_fd, &errs, &exit_code);
+  if (pid != -1)
+  {
+    initPump(&pumps[count], -1, in_fd, PUMP_CLOSE);
+    pumps[count++].src = &input;
+    initPump(&pumps[count], out_fd, -1, PUMP_KEEP);
+    pumps[count].dst = &own;
+    pumps[count].mode = PUMP_ENCODE;
+    pumps[count].compress = req->zip;
+    pumps[count++].frame_node = req->node;
+    initPump(&pumps[count], err_fd, -1, PUMP_KEEP);
+    pumps[count].dst = &errs;
+    pumps[count++].dst_limit = MAX_STDERR_SIZE;
+  }
+
+  // the upstream closing cfd cancels the broadcast
+  initPump(&pumps[count], cfd, -1, PUMP_KEEP);
+  pumps[count].mode = PUMP_DECODE;
+  pumps[count].end_seen = true;
+  pumps[count].watch_eof = true;
+  pumps[count++].abort_on = PUMP_ABORT_READ;
+
+  // the children enforce their own deadlines, only this node's command is
+  // timed here
+  if (pid != -1 && req->timeout_ms > 0)
+  {
+    struct itimerval timer = {{0, 0}, {req->timeout_ms / 1000, (req->timeout_ms % 1000) * 1000}};
+    relay_pid = pid;
+    signal(SIGALRM, relayDeadlineHandler);
+    setitimer(ITIMER_REAL, &timer, NULL);
+  }
+
+  int result = runPumps(pumps, count, 0);
+  struct itimerval off = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_REAL, &off, NULL);
+
+  char *state = relay_timed_out ? "timeout" : "ok";
+  if (result == PUMPS_ABORTED)
+  {
+    state = "cancelled";
+    if (pid != -1)
+      killpg(pid, SIGKILL);
+  }
+  for (int i = 0; i < fanout; i++)
+  {
+    if (child_fds[i] != -1)
+      close(child_fds[i]); // cancels the subtree if it is still running
+  }
+
+  if (pid != -1)
+  {
+    int status;
+    close(out_fd);
+    close(err_fd);
+    waitpid(pid, &status, 0);
+    exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+
+  writeAll(cfd, own.data, own.len);
+  for (int i = 0; i < fanout; i++)
+  {
+    writeAll(cfd, replies[i].data, replies[i].len);
+    bufferFree(&replies[i]);
+  }
+  sendResult(cfd, req->node, &errs, exit_code, state);
+
+  bufferFree(&input);
+  bufferFree(&own);
+  bufferFree(&errs);
+}
+
+/**
+ * @brief Reap finished workers and free their slots in the pool
+ */
+void reapWorkers()
+{
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+  {
+    int i = 0;
+    while (i < running && workers[i] != pid)
+      i++;
+    if (i < running)
+      workers[i] = workers[--running];
+    else
+      rejecting--;
+  }
+}
+
+/**
+ * @brief Fork a worker for the request. If reject is set, the worker only
+ * tells the sender that this node is too busy to take the request.
+ * 
+ * @param pr 
+ * @param reject 
+ */
+void startWorker(struct pending_request *pr, bool reject)
+{
+  // chdir in the daemon itself so that later requests run in the new dir,
+  // it is done when the request leaves the queue to keep the order
+  int cd_status = 0;
+  char *path = changeDirPath(pr->req.cmd);
+  if (path != NULL && !reject)
+    cd_status = chdir(path);
+
+  pid_t pid = fork();
+  if (pid == -1)
   {
-    // the command received from server has the form: "command\0command_input" where \0
-    // is the null character. The "command" is the actual shell command like "ls" and "cat"
-    // and the "command_input" is the input that should be sent to command (ie, the output of
-    // previous command in the pipe).
+    perror("[startWorker] fork error");
+  }
+  else if (pid == 0)
+  {
+    signal(SIGCHLD, SIG_DFL);
+    close(sfd2);
+    close(chld_pipe[0]);
+    close(chld_pipe[1]);
 
-    char *actual_cmd = cmd;
-    int actual_cmd_len = strlen(actual_cmd);    // since there is a null character after the actual command, this length would be length of actual command
-    char *cmd_input = cmd + actual_cmd_len + 1; // command input starts after the actual command and a null character
+    if (reject)
+    {
+      char buff[MAX_OUTPUT_SIZE + 1];
+      struct buffer errs;
+      bufferInit(&errs);
+      sprintf(buff, "Machine n%d is busy (%d running, %d queued), try again later.\n", pr->req.node, running, queued);
+      bufferAppend(&errs, buff, strlen(buff));
+      drainInput(pr->cfd);
+      sendResult(pr->cfd, pr->req.node, &errs, BUSY_EXIT_CODE, "busy");
+    }
+    else
+    {
+      running++; // count this worker in the load it reports
+      if (pr->req.relay_count > 0)
+        handleRelay(pr->cfd, &pr->req, cd_status);
+      else
+        handleRequest(pr->cfd, &pr->req, cd_status);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  else if (!reject)
+  {
+    workers[running++] = pid;
+  }
+  else
+  {
+    rejecting++;
+  }
 
-    // pipe is created here so that the command running on shell can take in the command_input we have passed
-    // we write the input to the pipe, close the write end and replace stdin with the read end of pipe
-    int pipe_fd[2];
-    assert(pipe(pipe_fd) != -1, "[executeCmd] pipe creation error", sfd1, sfd2);
+  close(pr->cfd);
+  free(pr);
+}
 
-    write(pipe_fd[1], cmd_input, strlen(cmd_input));
-    close(pipe_fd[1]);
+/**
+ * @brief Start a worker for a request whose header is in, or queue it if
+ * all workers are busy. A request that does not fit in the queue is
+ * rejected, or dropped if too many are being rejected already.
+ * 
+ * @param pr 
+ */
+void dispatchRequest(struct pending_request *pr)
+{
+  // the workers read the input frames blocking
+  fcntl(pr->cfd, F_SETFL, fcntl(pr->cfd, F_GETFL) & ~O_NONBLOCK);
+  pr->next = NULL;
 
-    assert(dup2(pipe_fd[0], STDIN_FILENO) != -1, "[executeCmd] dup2 pipe error", sfd1, sfd2);
+  if (running < max_running && queued == 0)
+  {
+    startWorker(pr, false);
+  }
+  else if (queued < MAX_QUEUED)
+  {
+    if (queue_tail)
+      queue_tail->next = pr;
+    else
+      queue_head = pr;
+    queue_tail = pr;
+    queued++;
+  }
+  else if (rejecting < MAX_REJECTING)
+  {
+    printf("Rejecting command %s, %d commands running and %d queued.\n", pr->req.cmd, running, queued);
+    startWorker(pr, true);
+  }
+  else
+  {
+    printf("Dropping command %s, %d commands running and %d queued.\n", pr->req.cmd, running, queued);
+    close(pr->cfd);
+    free(pr);
+  }
+}
 
-    FILE *fptr = popen(cmd, "r"); // run command
-                                  // store command in char buffer
-    int fd = fileno(fptr);
-    assert(fd != -1, "[executeCmd] error getting fd from fptr", sfd1, sfd2);
+/**
+ * @brief Read what has arrived of the header of a request and dispatch the
+ * request once it is in
+ * 
+ * @param pr 
+ * @return bool true if the request is done with reading, dispatched or
+ * dropped
+ */
+bool readHeader(struct pending_request *pr)
+{
+  int status = readRequestHeader(pr->cfd, &pr->req, &pr->header_len);
+  if (status == 0 && nowMs() < pr->deadline)
+    return false;
 
-    int num_read = 0;
-    char *buff = (char *)calloc(MAX_OUTPUT_SIZE + 1, sizeof(char));
-    num_read = read(fd, buff, MAX_OUTPUT_SIZE);
-    assert(num_read != -1, "error while reading from popen output", sfd1, sfd2);
-    buff[num_read] = '\0';
+  if (status == 1)
+  {
+    dispatchRequest(pr);
+    return true;
+  }
+  printf(status == 0 ? "Request header timed out, dropping it.\n" : "Malformed request received, dropping it.\n");
+  close(pr->cfd);
+  free(pr);
+  return true;
+}
 
-    close(pipe_fd[0]);
-    // return the output
-    return buff;
+/**
+ * @brief Accept a request and read its header, or keep it with those being
+ * read if the header is not in yet
+ * 
+ * @param sfd 
+ */
+void acceptRequest(int sfd)
+{
+  struct sockaddr_in caddr;
+  int clen = sizeof(caddr);
+  int cfd = accept(sfd, (struct sockaddr *)&caddr, (socklen_t *)&clen);
+  if (cfd == -1 && errno == EINTR)
+    return;
+  assert(cfd != -1, "error while clustershell_client accepting clustershell_server request.", sfd1, sfd2);
+  fcntl(cfd, F_SETFD, FD_CLOEXEC);
+  if (reading == MAX_QUEUED)
+  {
+    printf("Too many request headers being read, dropping a request.\n");
+    close(cfd);
+    return;
   }
+  fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+  struct pending_request *pr = (struct pending_request *)calloc(1, sizeof(struct pending_request));
+  assert(pr != NULL, "calloc error for pending request", sfd1, sfd2);
+  pr->cfd = cfd;
+  pr->deadline = nowMs() + HEADER_TIMEOUT_MS;
+  if (readHeader(pr))
+    return;
+  pr->next = reading_head;
+  reading_head = pr;
+  reading++;
+}
 
-  return NULL;
+/**
+ * @brief Send a heartbeat to the clustershell_server with the load of this
+ * machine. The server uses it to pick machines for nany commands and to
+ * find machines that have died.
+ * 
+ * @param ufd UDP socket
+ * @param saddr address of the server
+ * @param client_port port this client serves requests on, identifies it
+ */
+void sendHeartbeat(int ufd, struct sockaddr_in *saddr, int client_port)
+{
+  double load = 0;
+  long mem_free = 0;
+  struct sysinfo info;
+  getloadavg(&load, 1);
+  if (sysinfo(&info) == 0)
+    mem_free = (long)((info.freeram + info.bufferram) / 1024 * info.mem_unit / 1024);
+
+  char msg[256];
+  int len = sprintf(msg, "HB port=%d load=%.2f cpus=%ld mem=%ld running=%d queued=%d", client_port, load,
+                    sysconf(_SC_NPROCESSORS_ONLN), mem_free, running, queued);
+  sendto(ufd, msg, len, 0, (struct sockaddr *)saddr, sizeof(struct sockaddr_in));
 }
 
 int main(int argc, char **argv)
 {
-  if (argc != 4)
+  if (argc != 4 && argc != 5)
   {
-    errExit("\nUsage: client.out <SERVER_IP> <SERVER_PORT> <CLIENT_PORT>\n", sfd1, sfd2);
+    errExit("\nUsage: client.out <SERVER_IP> <SERVER_PORT> <CLIENT_PORT> [MAX_RUNNING]\n", sfd1, sfd2);
   }
 
   int client_port = atoi(argv[3]);
+  snprintf(unix_path, sizeof(unix_path), UNIX_SOCKET_TEMPLATE, client_port);
+  if (argc == 5)
+  {
+    max_running = atoi(argv[4]);
+    assert(max_running > 0, "MAX_RUNNING should be a positive number", sfd1, sfd2);
+  }
 
   pid_t child_pid;
   assert((child_pid = fork()) != -1, "client fork error", sfd1, sfd2);
@@ -123,43 +688,102 @@ int main(int argc, char **argv)
   if (child_pid == 0)
   {
     signal(SIGUSR1, sigUsrHandler);
+    signal(SIGPIPE, SIG_IGN);
     // inside child, do TCP communication
     // here, the clustershell_client will act as a server and wait for the
     // clustershell_server to send a request to run on this machine
 
     sfd2 = serverSetup(client_port);
-    int sfd = sfd2, cfd;
+    int sfd = sfd2;
+    sfd3 = unixServerSetup(unix_path);
+
+    workers = (pid_t *)calloc(max_running, sizeof(pid_t));
+    assert(workers != NULL, "calloc error for worker pool", sfd1, sfd2);
+    assert(pipe(chld_pipe) != -1, "pipe creation error", sfd1, sfd2);
+    fcntl(chld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(chld_pipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGCHLD, workerExitHandler);
+
+    // heartbeats are sent over UDP to the same port the server listens on
+    struct sockaddr_in hb_addr;
+    memset(&hb_addr, 0, sizeof(hb_addr));
+    hb_addr.sin_family = AF_INET;
+    hb_addr.sin_port = htons(atoi(argv[2]));
+    hb_addr.sin_addr.s_addr = inet_addr(argv[1]);
+    int ufd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(ufd != -1, "heartbeat socket creation error", sfd1, sfd2);
+    fcntl(ufd, F_SETFD, FD_CLOEXEC);
+    time_t next_heartbeat = 0;
 
     // wait for clustershell_server to send commands to clustershell_client
     for (;;)
     {
-      struct sockaddr_in caddr;
-      int clen = sizeof(caddr);
+      time_t now = time(NULL);
+      if (now >= next_heartbeat)
+      {
+        sendHeartbeat(ufd, &hb_addr, client_port);
+        next_heartbeat = now + HEARTBEAT_INTERVAL;
+      }
 
-      assert((cfd = accept(sfd, (struct sockaddr *)&caddr, (socklen_t *)&clen)) != -1, "error while clustershell_client accepting clustershell_server request.", sfd1, sfd2);
+      // wake up for the next heartbeat or the first header deadline
+      long long timeout = (next_heartbeat - now) * 1000;
+      struct pollfd fds[3 + MAX_QUEUED] = {{sfd, POLLIN, 0}, {chld_pipe[0], POLLIN, 0}, {sfd3, POLLIN, 0}};
+      int nfds = 3;
+      for (struct pending_request *pr = reading_head; pr; pr = pr->next)
+      {
+        fds[nfds++] = (struct pollfd){pr->cfd, POLLIN, 0};
+        if (pr->deadline - nowMs() < timeout)
+          timeout = pr->deadline - nowMs();
+      }
+      if (poll(fds, nfds, timeout < 0 ? 0 : timeout) == -1)
+      {
+        assert(errno == EINTR, "poll error in clustershell_client", sfd1, sfd2);
+        continue;
+      }
 
-      // read command from server
-      int sz = MAX_COMMAND_SIZE + 1 + MAX_OUTPUT_SIZE + 1;
-      char buff[sz];
-      int num_read = read(cfd, buff, sz);
-      assert(num_read != -1, "error while reading from server", sfd1, sfd2);
-      buff[num_read] = '\0';
+      if (fds[1].revents)
+      {
+        char drain[64];
+        while (read(chld_pipe[0], drain, sizeof(drain)) > 0)
+          ;
+        reapWorkers();
+      }
 
-      // execute the command
-      char *out = executeCmd(buff);
+      // the headers that came in or timed out, in the order of fds
+      struct pending_request **link = &reading_head;
+      for (int i = 3; i < nfds; i++)
+      {
+        struct pending_request *pr = *link, *next = pr->next;
+        if ((fds[i].revents || nowMs() >= pr->deadline) && readHeader(pr))
+        {
+          *link = next;
+          reading--;
+        }
+        else
+        {
+          link = &pr->next;
+        }
+      }
 
-      // send output to server
-      if (out != NULL)
+      if (fds[0].revents)
       {
-        write(cfd, out, strlen(out));
+        acceptRequest(sfd);
       }
-      else
+      if (fds[2].revents)
       {
-        write(cfd, "", 0);
+        acceptRequest(sfd3);
       }
 
-      free(out);
-      close(cfd);
+      // hand queued requests to free workers
+      while (running < max_running && queue_head)
+      {
+        struct pending_request *pr = queue_head;
+        queue_head = pr->next;
+        if (queue_head == NULL)
+          queue_tail = NULL;
+        queued--;
+        startWorker(pr, false);
+      }
     }
   }
   else
@@ -171,7 +795,12 @@ int main(int argc, char **argv)
     sfd1 = clientSetup(argv[1], atoi(argv[2]), -1);
     int sfd = sfd1;
 
-    write(sfd, argv[3], strlen(argv[3])); // send the port on which cs_client has setup server to the cs_server to enable cs_server to connect
+    // send the port on which cs_client has setup server to the cs_server to
+    // enable cs_server to connect, and the Unix socket it prefers if it
+    // runs on the same host, up to a newline
+    char registration[16 + UNIX_PATH_SIZE];
+    snprintf(registration, sizeof(registration), "%d %s\n", client_port, unix_path);
+    write(sfd, registration, strlen(registration));
 
     for (;;)
     {
@@ -210,17 +839,27 @@ int main(int argc, char **argv)
 
       free(cmd_input);
 
-      // read output from server
+      // read output from server, the end of it is marked by a null character
       char buff[MAX_OUTPUT_SIZE + 1];
-      int num_read = read(sfd, buff, MAX_OUTPUT_SIZE);
-      if (num_read <= 0)
+      bool end = false;
+      while (!end)
       {
-        kill(child_pid, SIGUSR1); // kill child
-        errExit("error while reading from server", sfd1, sfd2);
+        int num_read = read(sfd, buff, MAX_OUTPUT_SIZE);
+        if (num_read <= 0)
+        {
+          kill(child_pid, SIGUSR1); // kill child
+          errExit("error while reading from server", sfd1, sfd2);
+        }
+        char *nul = memchr(buff, '\0', num_read);
+        if (nul != NULL)
+        {
+          num_read = nul - buff;
+          end = true;
+        }
+        fwrite(buff, sizeof(char), num_read, stdout);
       }
-      buff[num_read] = '\0';
 
-      printf("%s\n", buff); // print output
+      printf("\n"); // print output
     }
     close(sfd);
   }
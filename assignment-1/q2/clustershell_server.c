@@ -7,14 +7,56 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <time.h>
 #include "./utils.h"
+#include "./cache.h"
+#include "./stats.h"
+
+#define MAX_JOBS 32                   // background jobs a session can hold
+#define JOB_MEMORY_LIMIT (256 * 1024) // larger job results stay on disk
+#define JOB_SPOOL_TEMPLATE "/tmp/clustershell_job_XXXXXX"
 
 // server socket file descriptor
 int sfd;
 
+// load of a machine, as reported in its heartbeats and the status frames
+// it sends. A machine that stops sending heartbeats is marked dead.
+typedef struct
+{
+  int running;
+  int queued;
+  double load_avg;
+  int cpus;
+  long mem_free; // MB
+  time_t last_heartbeat;
+  bool alive;
+} node_load;
+
+// guards the node loads, they are updated by the heartbeat thread and by
+// every client thread
+pthread_mutex_t loads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// what is collected from the frames other than output sent by nodes
+typedef struct
+{
+  struct buffer *diag;
+  node_load *loads;
+  bool reported[MAX_CLIENTS_ALLOWED + 1]; // nodes whose status arrived
+  bool failed[MAX_CLIENTS_ALLOWED + 1];   // nodes that wrote to stderr or failed
+  bool timed_out[MAX_CLIENTS_ALLOWED + 1]; // nodes that timed out or were cancelled
+  long long finished[MAX_CLIENTS_ALLOWED + 1]; // nowMs() when the status of each node arrived
+  bool stopped; // a command timed out or was cancelled
+  size_t sent;     // bytes sent to nodes by the command pipe
+  size_t received; // bytes received from nodes
+  bool zip; // nodes are asked to compress large outputs (ZIP 1)
+} chain_report;
+
+struct job;
+
 // struct for argument passed on to thread
 typedef struct
 {
@@ -24,17 +66,81 @@ typedef struct
   parsed_config *config;
   bool *active_connections;
   int *connection_ports;
+  char (*connection_paths)[UNIX_PATH_SIZE]; // Unix sockets of co-located nodes, empty for the others
+  node_load *loads;
+  int timeout_ms; // deadline of every command of the session, 0 for none
+  int relay_fanout; // broadcasts go down a relay tree with this fanout, 0 for off
+  struct job *jobs; // background jobs of the session, newest first
+  int job_count;
+  int next_job_id;
+  pthread_mutex_t jobs_lock;
+  pthread_cond_t jobs_cond; // signalled when a job finishes
+  bool closed; // the client has gone, results of jobs are dropped
+  bool cache_on; // use the result cache for the session's commands
+  int cache_ttl_ms; // how long results stored by the session are kept
+  struct session_stats stats; // command pipes run by the session
+  bool zip; // compress large outputs on the way between nodes and the server
 } arg_struct;
 
+// a command run in the background (eg: n1.sort big_file &). Its output is
+// spooled to a file while it runs, a small result is kept in memory once
+// the job is done.
+typedef struct job
+{
+  int id;
+  char *cmd;  // as typed, without the &
+  char *text; // copy of cmd the command pipe points into
+  struct command_pipe *cmd_pipe;
+  arg_struct *args;
+  int idx;
+  bool done;
+  long long started;
+  long long finished;
+  int spool_fd;
+  char spool_path[sizeof(JOB_SPOOL_TEMPLATE)];
+  struct buffer result;
+  size_t size;
+  struct job *next;
+} job;
+
+// where the frames of a broadcast relayed by nodes go: the output of each
+// node to its own buffer, the rest to the report
+typedef struct
+{
+  chain_report *report;
+  struct buffer *outputs;
+  int index[MAX_CLIENTS_ALLOWED + 1]; // position of each node in outputs
+} relay_report;
+
 void *connectionHandler(void *args);
 
+void *heartbeatHandler(void *args);
+
 int registerClientConnection(char *ip, parsed_config *config, bool *active_connections);
 
+void runCommandPipe(struct command_pipe *cmd_pipe, arg_struct *args, int idx, int out_fd, bool terminate);
+
+bool isBackground(char *cmd);
+
+int startJob(char *cmd, arg_struct *args, int idx, char *res, size_t size);
+
+void listJobs(arg_struct *args, char *res, int size);
+
+void sendJobResult(arg_struct *args, int id, bool wait);
+
+void freeJob(job *j);
+
+void dropJobs(arg_struct *args);
+
+void cacheCommand(arg_struct *args, char *arg, char *res, size_t size);
+
+void *statsHandler(void *args);
+
 int main(int argc, char **argv)
 {
-  if (argc != 2)
+  if (argc != 2 && argc != 3)
   {
-    errExit("\nUsage: server.out <SERVER_PORT>\n", sfd, -1);
+    errExit("\nUsage: server.out <SERVER_PORT> [STATS_INTERVAL]\n", sfd, -1);
   }
   assert(atoi(argv[1]) != CLIENT_PORT, "Given port reserved for client. Please enter a different port.", sfd, -1);
 
@@ -47,8 +153,13 @@ int main(int argc, char **argv)
   // activeConnections[i] is true when server is connected with client (i+1)
   bool *active_connections = (bool *)calloc(MAX_CLIENTS_ALLOWED, sizeof(bool));
   int *connection_ports = (int *)calloc(MAX_CLIENTS_ALLOWED, sizeof(int));
+  char(*connection_paths)[UNIX_PATH_SIZE] = calloc(MAX_CLIENTS_ALLOWED, UNIX_PATH_SIZE);
+  node_load *loads = (node_load *)calloc(MAX_CLIENTS_ALLOWED, sizeof(node_load));
   memset(active_connections, false, MAX_CLIENTS_ALLOWED);
 
+  // a node going away while we write to it should not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
   // parse config file
   parsed_config *config = parseConfigFile();
   pthread_t thread_id;
@@ -58,12 +169,33 @@ int main(int argc, char **argv)
   getsockname(sfd, (struct sockaddr *)&saddr, &slen);
   printf("\n ===== Server setup at %s:%d, waiting for connections =====\n", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
 
+  // receive heartbeats of the nodes on a UDP socket on the same port
+  arg_struct *hb_args = (arg_struct *)calloc(1, sizeof(arg_struct));
+  assert(hb_args != NULL, "calloc error while creating args object", sfd, -1);
+  hb_args->sfd = heartbeatSetup(atoi(argv[1]));
+  hb_args->cfd = -1;
+  hb_args->config = config;
+  hb_args->active_connections = active_connections;
+  hb_args->connection_ports = connection_ports;
+  hb_args->loads = loads;
+  assert(pthread_create(&thread_id, NULL, heartbeatHandler, (void *)hb_args) == 0, "pthread_create error", sfd, -1);
+
+  // dump the stats every STATS_INTERVAL seconds, if asked to
+  static int stats_interval;
+  if (argc == 3 && (stats_interval = atoi(argv[2])) > 0)
+    assert(pthread_create(&thread_id, NULL, statsHandler, (void *)&stats_interval) == 0, "pthread_create error", sfd, -1);
+
   for (;;)
   {
     // accept connection
     cfd = accept(sfd, (struct sockaddr *)&caddr, (socklen_t *)&clen);
     assert(cfd != -1, "error while clustershell_server accepting clustershell_client request.", sfd, -1);
 
+    // output ends with a small write of the terminator, which must not wait
+    // for the ACK of the frames before it
+    int nodelay = 1;
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     // create args structure for thread
     arg_struct *args = (arg_struct *)calloc(1, sizeof(arg_struct));
     assert(args != NULL, "calloc error while creating args object", sfd, -1);
@@ -73,6 +205,11 @@ int main(int argc, char **argv)
     args->config = config;
     args->active_connections = active_connections;
     args->connection_ports = connection_ports;
+    args->connection_paths = connection_paths;
+    args->loads = loads;
+    args->cache_ttl_ms = CACHE_DEFAULT_TTL_MS;
+    pthread_mutex_init(&args->jobs_lock, NULL);
+    pthread_cond_init(&args->jobs_cond, NULL);
 
     // create thread
     assert(pthread_create(&thread_id, NULL, connectionHandler, (void *)args) == 0, "pthread_create error", sfd, -1);
@@ -105,6 +242,77 @@ int registerClientConnection(char *ip, parsed_config *config, bool *active_conne
   return -1;
 }
 
+/**
+ * @brief Receive heartbeats of the nodes and record their load. Nodes
+ * whose heartbeats stop for HEARTBEAT_TIMEOUT seconds are marked dead, so
+ * that they are not listed, scheduled on or broadcast to until their
+ * heartbeats resume.
+ * 
+ * @param args sfd is the UDP socket heartbeats arrive on
+ * @return void* 
+ */
+void *heartbeatHandler(void *args)
+{
+  int ufd = ((arg_struct *)args)->sfd;
+  parsed_config *config = ((arg_struct *)args)->config;
+  bool *active_connections = ((arg_struct *)args)->active_connections;
+  int *connection_ports = ((arg_struct *)args)->connection_ports;
+  node_load *loads = ((arg_struct *)args)->loads;
+
+  for (;;)
+  {
+    struct pollfd pfd = {ufd, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) > 0)
+    {
+      char msg[257];
+      struct sockaddr_in addr;
+      socklen_t alen = sizeof(addr);
+      int len = recvfrom(ufd, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&addr, &alen);
+      if (len > 0)
+      {
+        msg[len] = '\0';
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+        int port = 0;
+        node_load load = {0};
+        sscanf(msg, "HB port=%d load=%lf cpus=%d mem=%ld running=%d queued=%d", &port, &load.load_avg, &load.cpus,
+               &load.mem_free, &load.running, &load.queued);
+
+        // the node is identified by its IP and the port it serves requests on
+        for (int i = 0; i < config->count; i++)
+        {
+          if (!active_connections[i] || connection_ports[i] != port || strcmp(config->data[i], ip) != 0)
+            continue;
+          pthread_mutex_lock(&loads_lock);
+          if (!loads[i].alive)
+            printf("\n=== Machine n%d is sending heartbeats again ===\n", i + 1);
+          load.last_heartbeat = time(NULL);
+          load.alive = true;
+          loads[i] = load;
+          pthread_mutex_unlock(&loads_lock);
+          break;
+        }
+      }
+    }
+
+    // drop nodes that missed their heartbeats
+    time_t now = time(NULL);
+    pthread_mutex_lock(&loads_lock);
+    for (int i = 0; i < config->count; i++)
+    {
+      if (active_connections[i] && loads[i].alive && now - loads[i].last_heartbeat > HEARTBEAT_TIMEOUT)
+      {
+        printf("\n=== Machine n%d missed its heartbeats, marking it dead ===\n", i + 1);
+        loads[i].alive = false;
+      }
+    }
+    pthread_mutex_unlock(&loads_lock);
+  }
+
+  return NULL;
+}
+
 /**
  * @brief Handle each client
  * 
@@ -114,12 +322,14 @@ int registerClientConnection(char *ip, parsed_config *config, bool *active_conne
 void *connectionHandler(void *args)
 {
   // deconstruct args
-  int sfd = ((arg_struct *)args)->sfd, cfd = ((arg_struct *)args)->cfd;
+  int cfd = ((arg_struct *)args)->cfd;
   struct sockaddr_in caddr = ((arg_struct *)args)->caddr;
   char *client_ip = inet_ntoa(caddr.sin_addr);
   parsed_config *config = ((arg_struct *)args)->config;
   bool *active_connections = ((arg_struct *)args)->active_connections;
   int *connection_ports = ((arg_struct *)args)->connection_ports;
+  char(*connection_paths)[UNIX_PATH_SIZE] = ((arg_struct *)args)->connection_paths;
+  node_load *loads = ((arg_struct *)args)->loads;
 
   printf("\n=== Connected with client IP %s ===\n", client_ip);
 
@@ -133,9 +343,26 @@ void *connectionHandler(void *args)
 
   // read the port from client on which the client is establishing server
   // to run commands being sent to it. This is done to enable two clients
-  // having the same IP but different ports.
-  char client_port_str[10];
-  int nread = read(cfd, client_port_str, 10);
+  // having the same IP but different ports. It may be followed by the path
+  // of a Unix socket the client also listens on. It ends with a newline and
+  // is read a byte at a time, so that a command sent right behind it is
+  // left for the command loop.
+  char client_port_str[16 + UNIX_PATH_SIZE];
+  int nread = 0;
+  while (nread < (int)sizeof(client_port_str) - 1)
+  {
+    int n = read(cfd, client_port_str + nread, 1);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      nread = nread == 0 ? n : nread;
+      break;
+    }
+    if (client_port_str[nread] == '\n')
+      break;
+    nread++;
+  }
   if (nread == 0)
   {
     // connection has been closed
@@ -154,6 +381,30 @@ void *connectionHandler(void *args)
   printf("~ Will be sending commands to machine n%d at %s:%s ~\n", idx + 1, client_ip, client_port_str);
   connection_ports[idx] = atoi(client_port_str);
 
+  // a client connecting from the address it reached us on runs on this
+  // host, commands are sent to it over its Unix socket
+  struct sockaddr_in laddr;
+  socklen_t llen = sizeof(laddr);
+  char *path = strchr(client_port_str, ' ');
+  bool local = getsockname(cfd, (struct sockaddr *)&laddr, &llen) == 0 && laddr.sin_addr.s_addr == caddr.sin_addr.s_addr;
+  if (local && path != NULL && path[1] == '/')
+  {
+    snprintf(connection_paths[idx], UNIX_PATH_SIZE, "%s", path + 1);
+    printf("~ Machine n%d is on this host, using its Unix socket %s ~\n", idx + 1, connection_paths[idx]);
+  }
+  else
+    connection_paths[idx][0] = '\0';
+
+  // the node counts as alive until it misses its first heartbeats
+  pthread_mutex_lock(&loads_lock);
+  memset(&loads[idx], 0, sizeof(node_load));
+  loads[idx].last_heartbeat = time(NULL);
+  loads[idx].alive = true;
+  pthread_mutex_unlock(&loads_lock);
+
+  // a new node on this machine, whatever was cached for the old one is stale
+  cacheInvalidate(idx + 1);
+
   // read commands from client
   for (;;)
   {
@@ -174,13 +425,16 @@ void *connectionHandler(void *args)
       // return a list of active nodes
       int curr_offset = 0;
       char res[MAX_OUTPUT_SIZE + 1];
-      for (int i = 0; i < MAX_CLIENTS_ALLOWED; i++)
+      pthread_mutex_lock(&loads_lock);
+      for (int i = 0; i < MAX_CLIENTS_ALLOWED && curr_offset < MAX_OUTPUT_SIZE - 128; i++)
       {
-        if (active_connections[i])
+        if (active_connections[i] && loads[i].alive)
         {
-          curr_offset += sprintf(res + curr_offset, "n%d %s\n", i + 1, config->data[i]);
+          curr_offset += sprintf(res + curr_offset, "n%d %s running=%d queued=%d load=%.2f mem=%ldMB\n", i + 1, config->data[i],
+                                 loads[i].running, loads[i].queued, loads[i].load_avg, loads[i].mem_free);
         }
       }
+      pthread_mutex_unlock(&loads_lock);
       res[curr_offset] = '\0';
 
       // write output to client
@@ -188,150 +442,1284 @@ void *connectionHandler(void *args)
       continue;
     }
 
-    /** --- Command is other than "nodes" --- **/
+    if (strncmp(buff, "timeout", 7) == 0 && (buff[7] == '\0' || buff[7] == ' '))
+    {
+      // "timeout <duration>|off" sets the deadline of the session's commands
+      char res[MAX_OUTPUT_SIZE + 1];
+      char *value = buff + 7;
+      while (*value == ' ')
+        value++;
+      int timeout_ms = strcmp(value, "off") == 0 ? 0 : parseDuration(value);
+      if (*value == '\0')
+        sprintf(res, "timeout: %dms\n", ((arg_struct *)args)->timeout_ms);
+      else if (timeout_ms == -1)
+        snprintf(res, sizeof(res), "Invalid timeout %s, use eg: timeout 10s, timeout 500ms or timeout off\n", value);
+      else
+      {
+        ((arg_struct *)args)->timeout_ms = timeout_ms;
+        sprintf(res, "timeout set to %dms\n", timeout_ms);
+      }
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    if (strncmp(buff, "relay", 5) == 0 && (buff[5] == '\0' || buff[5] == ' '))
+    {
+      // "relay <fanout>|off" sends broadcasts down a tree of nodes
+      char res[MAX_OUTPUT_SIZE + 1];
+      char *value = buff + 5;
+      while (*value == ' ')
+        value++;
+      int fanout = strcmp(value, "off") == 0 ? 0 : atoi(value);
+      if (*value == '\0' && ((arg_struct *)args)->relay_fanout == 0)
+        sprintf(res, "relay: off\n");
+      else if (*value == '\0')
+        sprintf(res, "relay: fanout %d\n", ((arg_struct *)args)->relay_fanout);
+      else if (fanout < 0 || (fanout == 0 && strcmp(value, "off") != 0) || fanout == 1)
+        snprintf(res, sizeof(res), "Invalid fanout %s, use eg: relay 4 or relay off\n", value);
+      else
+      {
+        ((arg_struct *)args)->relay_fanout = fanout;
+        sprintf(res, fanout ? "relay fanout set to %d\n" : "relay off\n", fanout);
+      }
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    if (strncmp(buff, "zip", 3) == 0 && (buff[3] == '\0' || buff[3] == ' '))
+    {
+      // "zip on|off" compresses large outputs sent between nodes and the server
+      char res[MAX_OUTPUT_SIZE + 1];
+      char *value = buff + 3;
+      while (*value == ' ')
+        value++;
+      if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)
+        ((arg_struct *)args)->zip = value[1] == 'n';
+      if (*value == '\0' || strcmp(value, "on") == 0 || strcmp(value, "off") == 0)
+        sprintf(res, "zip: %s\n", ((arg_struct *)args)->zip ? "on" : "off");
+      else
+        snprintf(res, sizeof(res), "Invalid setting %s, use zip on or zip off\n", value);
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    if (strncmp(buff, "cache", 5) == 0 && (buff[5] == '\0' || buff[5] == ' '))
+    {
+      // "cache on|off|ttl <duration>|clear [n<id>]|stats"
+      char res[MAX_OUTPUT_SIZE + 1];
+      cacheCommand((arg_struct *)args, buff + 5, res, sizeof(res));
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    if (strcmp(buff, "stats") == 0)
+    {
+      // counters of every node, of the session and of the whole server
+      struct buffer res;
+      bufferInit(&res);
+      statsReport(&((arg_struct *)args)->stats, &res);
+      bufferAppend(&res, "", 1);
+      writeAll(cfd, res.data, res.len);
+      bufferFree(&res);
+      continue;
+    }
+
+    if (strcmp(buff, "jobs") == 0)
+    {
+      char res[MAX_OUTPUT_SIZE * 4 + 1];
+      listJobs((arg_struct *)args, res, sizeof(res));
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    if (strncmp(buff, "result ", 7) == 0 || strncmp(buff, "wait ", 5) == 0)
+    {
+      // "result <id>" returns the output of a finished job, "wait <id>"
+      // waits for the job to finish first
+      bool wait = buff[0] == 'w';
+      sendJobResult((arg_struct *)args, atoi(buff + (wait ? 5 : 7)), wait);
+      continue;
+    }
+
+    /** --- Command is other than the built-in ones --- **/
 
-    // create command pipe linked list
+    if (isBackground(buff))
+    {
+      char res[MAX_OUTPUT_SIZE + 1];
+      startJob(buff, (arg_struct *)args, idx, res, sizeof(res));
+      write(cfd, res, strlen(res) + 1);
+      continue;
+    }
+
+    // "plan <command>" only reports how the command would be run
+    bool plan_only = strncmp(buff, "plan ", 5) == 0;
+
+    // create command pipe linked list and merge consecutive commands on the same machine
     struct command_pipe *cmd_pipe = initCommandPipe();
-    createCommandPipe(buff, cmd_pipe);
-    struct command *curr_cmd = cmd_pipe->head;
-    char output[MAX_OUTPUT_SIZE + 1];
-    int output_read_num;
-    memset(output, '\0', MAX_OUTPUT_SIZE + 1);
+    createCommandPipe(plan_only ? buff + 5 : buff, cmd_pipe);
+    planCommandPipe(cmd_pipe, idx + 1);
 
-    bool err = false;
+    char plan[MAX_OUTPUT_SIZE + 1];
+    int plan_len = formatCommandPipe(cmd_pipe, plan, sizeof(plan));
+    printf("~ Plan: %s ~\n", plan);
 
-    while (curr_cmd)
+    if (plan_only)
+      write(cfd, plan, plan_len + 1);
+    else
     {
-      if (curr_cmd->machine == 0)
-      { // broadcast
+      runCommandPipe(cmd_pipe, (arg_struct *)args, idx, cfd, true);
+    }
 
-        char res[MAX_OUTPUT_SIZE + 1];
-        memset(res, '\0', MAX_OUTPUT_SIZE + 1);
-        int offset = 0;
+    resetCommandPipe(cmd_pipe);
+    free(cmd_pipe);
+  }
 
-        // loop through all currently active connections
-        for (int i = 0; i < config->count; i++)
-        {
-          if (active_connections[i] == false)
-          {
-            continue;
-          }
-          printf("-> Running command %s on machine n%d (%s:%d)\n", curr_cmd->cmd, i + 1, config->data[i], connection_ports[i]);
-          int cfd_client = clientSetup(config->data[i], connection_ports[i], sfd); // act as a client and send request to the machine
-          int cmd_len = strlen(curr_cmd->cmd);
-
-          // send command to server (clustershell_client)
-          char input[MAX_COMMAND_SIZE + 1 + MAX_OUTPUT_SIZE + 1];
-          strcpy(input, curr_cmd->cmd);                      // copy the command to input array
-          input[strlen(curr_cmd->cmd)] = '\0';               // a \0 (null) separater between the command and input to the command
-          strcpy(input + strlen(curr_cmd->cmd) + 1, output); // copy the previous output which will hence be the input to this command
-
-          int sz = strlen(input) + 1 + strlen(output) + 1;
-          int write_num = write(cfd_client, input, sz);
-          if (write_num != sz)
-          {
-            printf("Error in writing command %s to machine n%d.\n", curr_cmd->cmd, i + 1);
-            err = true;
-            sprintf(output, "Error in writing command %s to machine n%d.\n", curr_cmd->cmd, i + 1);
-            break;
-          }
-
-          // read output of command from server (clustershell_client)
-          char temp[MAX_OUTPUT_SIZE + 1];
-          int res_read_num = read(cfd_client, temp, MAX_OUTPUT_SIZE);
-          if (res_read_num == -1)
-          {
-            printf("Error in reading output of command %s from machine n%d.\n", curr_cmd->cmd, i + 1);
-            err = true;
-            sprintf(output, "Error in reading output of command %s from machine n%d.\n", curr_cmd->cmd, i + 1);
-            break;
-          }
-          temp[res_read_num] = '\0';
-          strcat(res, temp); // concatenate current response to final response
-          offset += res_read_num;
-
-          close(cfd_client);
-        }
+  active_connections[idx] = false;
+  dropJobs((arg_struct *)args);
+  close(cfd);
+  return NULL;
+}
+/**
+ * @brief Pick the least loaded live machine for a nany command. Machines
+ * in exclude are only picked if no other machine is alive. The pick is
+ * counted as a running command right away, so that a burst of nany
+ * commands spreads over the cluster before the machines report back.
+ * 
+ * @param args 
+ * @param exclude 
+ * @param exclude_count 
+ * @return int machine index, or -1 if no machine is alive
+ */
+int pickLeastLoaded(arg_struct *args, int *exclude, int exclude_count)
+{
+  node_load *loads = args->loads;
+  int best = -1;
+  double best_score = 0;
+  bool best_excluded = true;
+
+  pthread_mutex_lock(&loads_lock);
+  for (int i = 0; i < args->config->count; i++)
+  {
+    if (!args->active_connections[i] || !loads[i].alive)
+      continue;
+    bool excluded = false;
+    for (int j = 0; j < exclude_count; j++)
+      excluded = excluded || exclude[j] == i;
+
+    // commands waiting on the machine plus its load average per cpu
+    double score = loads[i].running + loads[i].queued + loads[i].load_avg / (loads[i].cpus > 0 ? loads[i].cpus : 1);
+    if (best == -1 || (best_excluded && !excluded) || (excluded == best_excluded && score < best_score))
+    {
+      best = i;
+      best_score = score;
+      best_excluded = excluded;
+    }
+  }
+  if (best != -1)
+    loads[best].running += 1;
+  pthread_mutex_unlock(&loads_lock);
+
+  return best;
+}
+
+/**
+ * @brief Get the machine index a (non broadcast) command should run on
+ * 
+ * @param cmd 
+ * @param args 
+ * @param idx index of the machine the request came from
+ * @param chain machines already in the chain, avoided by nany commands
+ * @param chain_count 
+ * @param err set to an error message if the machine can not be used
+ * @return int machine index, or -1 on error
+ */
+int resolveMachine(struct command *cmd, arg_struct *args, int idx, int *chain, int chain_count, char *err)
+{
+  int machine = cmd->machine;
+  if (machine == MACHINE_ANY)
+  { // least loaded machine
+    if ((machine = pickLeastLoaded(args, chain, chain_count)) == -1)
+    {
+      printf("No machine is alive to run command %s.\n", cmd->cmd);
+      sprintf(err, "No machine is alive to run command %s.\n", cmd->cmd);
+    }
+    return machine;
+  }
+  else if (machine == -1)
+  { // run on same machine from which request came
+    machine = idx;
+  }
+  else
+  {
+    machine -= 1; // since it is used as array index
+  }
+
+  if (machine >= args->config->count)
+  {
+    printf("Invalid machine name found: n%d. Please verify that it exists in config in correct order.\n", machine + 1);
+    sprintf(err, "Invalid machine name found: n%d. Please verify that it exists in config in correct order.\n", machine + 1);
+    return -1;
+  }
+
+  if (args->active_connections[machine] == false)
+  {
+    printf("Machine n%d is not connected.\n", machine + 1);
+    sprintf(err, "Machine n%d is not connected.", machine + 1);
+    return -1;
+  }
+
+  if (args->loads[machine].alive == false)
+  {
+    printf("Machine n%d is not responding.\n", machine + 1);
+    sprintf(err, "Machine n%d is not responding.", machine + 1);
+    return -1;
+  }
+
+  return machine;
+}
+
+/**
+ * @brief Unix socket of a machine co-located with the server
+ * 
+ * @param args 
+ * @param machine 
+ * @return char* the path, or NULL if the machine is reached over TCP
+ */
+char *machinePath(arg_struct *args, int machine)
+{
+  return args->connection_paths[machine][0] ? args->connection_paths[machine] : NULL;
+}
+
+/**
+ * @brief Collect the stderr and non zero exit statuses reported by nodes,
+ * and the load they report along with their exit status. Commands that
+ * timed out or were cancelled stop the command pipe.
+ * 
+ * @param hdr 
+ * @param payload 
+ * @param arg chain_report the frames are collected in
+ */
+void collectDiagnostics(struct frame_header *hdr, char *payload, void *arg)
+{
+  chain_report *report = (chain_report *)arg;
+  int len = hdr->len < MAX_FRAME_PAYLOAD ? hdr->len : MAX_FRAME_PAYLOAD;
+
+  if (hdr->type == FRAME_ERR)
+  {
+    bufferAppend(report->diag, payload, len);
+    if (hdr->node > 0 && hdr->node <= MAX_CLIENTS_ALLOWED)
+      report->failed[hdr->node] = true;
+  }
+  else if (hdr->type == FRAME_STATUS)
+  {
+    char status[MAX_FRAME_PAYLOAD + 1];
+    char state[16] = "ok";
+    int exit_code = 0;
+    node_load load = {.running = 0, .queued = 0};
+    memcpy(status, payload, len);
+    status[len] = '\0';
+    sscanf(status, "exit=%d running=%d queued=%d state=%15s", &exit_code, &load.running, &load.queued, state);
+    if (hdr->node > 0 && hdr->node <= MAX_CLIENTS_ALLOWED)
+    {
+      report->reported[hdr->node] = true;
+      report->finished[hdr->node] = nowMs();
+      pthread_mutex_lock(&loads_lock);
+      report->loads[hdr->node - 1].running = load.running;
+      report->loads[hdr->node - 1].queued = load.queued;
+      pthread_mutex_unlock(&loads_lock);
+    }
+    if (hdr->node > 0 && hdr->node <= MAX_CLIENTS_ALLOWED && (exit_code != 0 || strcmp(state, "ok") != 0))
+      report->failed[hdr->node] = true;
+    if (strcmp(state, "timeout") == 0 || strcmp(state, "cancelled") == 0)
+    {
+      char line[64];
+      printf("-> Command on machine n%d %s\n", hdr->node, state[0] == 't' ? "timed out" : "was cancelled");
+      sprintf(line, "n%d: %s\n", hdr->node, state[0] == 't' ? "timed out, killed" : "cancelled");
+      bufferAppend(report->diag, line, strlen(line));
+      report->stopped = true;
+      if (hdr->node > 0 && hdr->node <= MAX_CLIENTS_ALLOWED)
+        report->timed_out[hdr->node] = true;
+    }
+    else if (exit_code != 0)
+    {
+      char line[64];
+      printf("-> Command on machine n%d exited with status %d\n", hdr->node, exit_code);
+      sprintf(line, "n%d: exited with status %d\n", hdr->node, exit_code);
+      bufferAppend(report->diag, line, strlen(line));
+    }
+  }
+}
+
+/**
+ * @brief Connect to the first node of a chain and send it the request
+ * header
+ * 
+ * @param hops 
+ * @param count number of hops
+ * @param relays nodes the first node relays a broadcast to, or NULL
+ * @param relay_count 
+ * @param fanout 
+ * @param zip frames may be compressed
+ * @param err set to an error message on failure
+ * @return int socket fd, or -1 on error
+ */
+int openChain(struct hop *hops, int count, struct hop *relays, int relay_count, int fanout, bool zip, char *err)
+{
+  // act as a client and send request to the machine, over its Unix socket
+  // if it is co-located
+  int nfd = hops[0].path ? clientConnect(hops[0].path, hops[0].port) : -1;
+  if (nfd == -1)
+    nfd = clientConnect(hops[0].ip, hops[0].port);
+  if (nfd == -1)
+  {
+    sprintf(err, "Could not connect to machine n%d at %s:%d to run command %s.\n", hops[0].node, hops[0].ip, hops[0].port, hops[0].cmd);
+    statsConnectionError(hops[0].node);
+    return -1;
+  }
+
+  if (writeRequestHeader(nfd, hops, count, relays, relay_count, fanout, zip) == -1)
+  {
+    printf("Error in writing command %s to machine n%d.\n", hops[0].cmd, hops[0].node);
+    sprintf(err, "Error in writing command %s to machine n%d.\n", hops[0].cmd, hops[0].node);
+    statsConnectionError(hops[0].node);
+    close(nfd);
+    return -1;
+  }
+  return nfd;
+}
+
+/**
+ * @brief Init the pair of pumps of a chain: the input is sent to the node
+ * as frames while its output is decoded, and every other frame goes to the
+ * report. The connection stays open after the input, closing it cancels.
+ * 
+ * @param pumps two pumps
+ * @param nfd 
+ * @param input 
+ * @param out_fd fd the output is streamed to, or -1
+ * @param output buffer the output is collected in when out_fd is -1
+ * @param report 
+ */
+void initChainPumps(struct pump *pumps, int nfd, struct buffer_list *input, int out_fd, struct buffer *output, chain_report *report)
+{
+  initPump(&pumps[0], -1, nfd, PUMP_KEEP);
+  pumps[0].src_list = input;
+  pumps[0].mode = PUMP_ENCODE;
+  pumps[0].end_frame = true;
+  pumps[0].compress = report->zip;
+  initPump(&pumps[1], nfd, out_fd, PUMP_KEEP);
+  pumps[1].dst = output;
+  pumps[1].mode = PUMP_DECODE;
+  pumps[1].on_frame = collectDiagnostics;
+  pumps[1].frame_arg = report;
+  pumps[1].abort_on = PUMP_ABORT_WRITE; // the client went away
+}
+
+/**
+ * @brief Deadline the server gives the nodes running the hops. Nodes
+ * enforce the deadlines of their own commands. If all commands have one,
+ * the server gives up a grace period after the longest, in case a node
+ * cannot even report back, and at the deadline of the whole command pipe
+ * anyway.
+ * 
+ * @param hops 
+ * @param count 
+ * @param deadline nowMs() based deadline of the command pipe, 0 for none
+ * @return long long 
+ */
+long long hopsDeadline(struct hop *hops, int count, long long deadline)
+{
+  // the longest deadline of the commands, -1 if a command has none
+  int longest = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (hops[i].timeout_ms == 0)
+    {
+      longest = -1;
+      break;
+    }
+    if (hops[i].timeout_ms > longest)
+      longest = hops[i].timeout_ms;
+  }
+  if (longest > 0 && (deadline == 0 || nowMs() + longest + TIMEOUT_GRACE_MS < deadline))
+    deadline = nowMs() + longest + TIMEOUT_GRACE_MS;
+  return deadline;
+}
+
+/**
+ * @brief Forget what was reported by the nodes of the hops in an earlier
+ * run, and count their commands as in flight
+ * 
+ * @param hops 
+ * @param count 
+ * @param report 
+ */
+void beginHops(struct hop *hops, int count, chain_report *report)
+{
+  for (int i = 0; i < count; i++)
+  {
+    int node = hops[i].node;
+    report->reported[node] = report->failed[node] = report->timed_out[node] = false;
+    statsNodeStart(node);
+  }
+}
+
+/**
+ * @brief Count the commands of the hops as done in the stats of their
+ * nodes. The latency of a node runs until its status arrived, or until the
+ * run ended if it never did.
+ * 
+ * @param hops 
+ * @param count 
+ * @param report 
+ * @param started nowMs() when the run started
+ * @param sent bytes sent to each node
+ * @param received bytes received from each node
+ * @param status result of runPumps
+ */
+void recordHops(struct hop *hops, int count, chain_report *report, long long started, size_t *sent, size_t *received, int status)
+{
+  long long now = nowMs();
+  for (int i = 0; i < count; i++)
+  {
+    int node = hops[i].node;
+    int outcome = STATS_OK;
+    if (!report->reported[node])
+      outcome = status == PUMPS_OK || status == PUMPS_TIMEOUT ? STATS_TIMEOUT : STATS_ERROR;
+    else if (report->timed_out[node])
+      outcome = STATS_TIMEOUT;
+    else if (report->failed[node])
+      outcome = STATS_FAILED;
+    statsNodeDone(node, (report->reported[node] ? report->finished[node] : now) - started, sent[i], received[i], outcome);
+    report->sent += sent[i];
+    report->received += received[i];
+  }
+}
+
+/**
+ * @brief List the nodes that did not report a status as timed out or
+ * cancelled, depending on how the run ended
+ * 
+ * @param hops 
+ * @param count 
+ * @param report 
+ * @param status result of runPumps
+ */
+void reportMissing(struct hop *hops, int count, chain_report *report, int status)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (report->reported[hops[i].node])
+      continue;
+    char line[64];
+    sprintf(line, "n%d: %s, no status received\n", hops[i].node, status == PUMPS_TIMEOUT ? "timed out" : "cancelled");
+    bufferAppend(report->diag, line, strlen(line));
+    report->stopped = true;
+  }
+}
+
+/**
+ * @brief Run a chain of commands on the given nodes. Only the first node
+ * is contacted, it is told about the hops after it and streams its output
+ * directly to the next node, which does the same. The output of the last
+ * node travels back through the chain, followed by the stderr and exit
+ * status of every node. The input is sent to the first node while the
+ * final output is being received, so all the stages overlap.
+ * Giving up on the chain (see hopsDeadline) closes the connection, which
+ * cancels the commands down the chain. Nodes that did not report are
+ * listed as such.
+ * 
+ * @param hops 
+ * @param count number of hops
+ * @param input input of the first command
+ * @param out_fd fd the final output is streamed to, or -1
+ * @param output buffer the final output is collected in when out_fd is -1
+ * @param report collects stderr, failed exit statuses and node loads
+ * @param deadline nowMs() based deadline of the command pipe, 0 for none
+ * @param err set to an error message on failure
+ * @return int PUMPS_OK, PUMPS_TIMEOUT, or -1 on error
+ */
+int runChain(struct hop *hops, int count, struct buffer_list *input, int out_fd, struct buffer *output, chain_report *report, long long deadline, char *err)
+{
+  long long started = nowMs();
+  int nfd = openChain(hops, count, NULL, 0, 0, report->zip, err);
+  if (nfd == -1)
+    return -1;
+
+  struct pump pumps[2];
+  initChainPumps(pumps, nfd, input, out_fd, output, report);
+  beginHops(hops, count, report);
+
+  int status = runPumps(pumps, 2, hopsDeadline(hops, count, deadline));
+  close(nfd);
+
+  // the input goes to the first node, the output comes from the last one
+  size_t sent[count], received[count];
+  memset(sent, 0, sizeof(sent));
+  memset(received, 0, sizeof(received));
+  sent[0] = pumps[0].bytes;
+  received[count - 1] = pumps[1].bytes;
+  recordHops(hops, count, report, started, sent, received, status);
+
+  if (status == PUMPS_OK || status == PUMPS_TIMEOUT)
+  {
+    reportMissing(hops, count, report, status);
+    if (status == PUMPS_TIMEOUT)
+      printf("-> Gave up on command %s on machine n%d, deadline exceeded\n", hops[0].cmd, hops[0].node);
+  }
+  else
+  {
+    printf("Error in reading output of command %s from machine n%d.\n", hops[0].cmd, hops[0].node);
+    sprintf(err, "Error in reading output of command %s from machine n%d.\n", hops[0].cmd, hops[0].node);
+    status = -1;
+  }
+  return status;
+}
+
+/**
+ * @brief Run one command on several nodes at the same time, each node with
+ * its own input and output. This is how broadcasts and partitioned
+ * commands run: all nodes are contacted up front and pumped together, so
+ * the slowest node sets the time taken rather than the sum of all nodes.
+ * 
+ * @param hops one hop per node
+ * @param count number of nodes
+ * @param inputs input of each node
+ * @param outputs buffer each node's output is collected in
+ * @param report collects stderr, failed exit statuses and node loads
+ * @param deadline nowMs() based deadline of the command pipe, 0 for none
+ * @param err set to an error message on failure
+ * @return int PUMPS_OK, PUMPS_TIMEOUT, or -1 on error
+ */
+int runFanout(struct hop *hops, int count, struct buffer_list **inputs, struct buffer *outputs, chain_report *report, long long deadline, char *err)
+{
+  if (count == 0)
+    return PUMPS_OK;
+
+  long long started = nowMs();
+  int nfds[count];
+  struct pump pumps[2 * count];
+  for (int i = 0; i < count; i++)
+  {
+    if ((nfds[i] = openChain(&hops[i], 1, NULL, 0, 0, report->zip, err)) == -1)
+    {
+      while (i-- > 0)
+        close(nfds[i]);
+      return -1;
+    }
+    initChainPumps(&pumps[2 * i], nfds[i], inputs[i], -1, &outputs[i], report);
+  }
+  beginHops(hops, count, report);
+
+  int status = runPumps(pumps, 2 * count, hopsDeadline(hops, count, deadline));
+  size_t sent[count], received[count];
+  for (int i = 0; i < count; i++)
+  {
+    close(nfds[i]);
+    sent[i] = pumps[2 * i].bytes;
+    received[i] = pumps[2 * i + 1].bytes;
+  }
+  recordHops(hops, count, report, started, sent, received, status);
+
+  if (status == PUMPS_OK || status == PUMPS_TIMEOUT)
+  {
+    reportMissing(hops, count, report, status);
+    if (status == PUMPS_TIMEOUT)
+      printf("-> Gave up on command %s, deadline exceeded\n", hops[0].cmd);
+  }
+  else
+  {
+    printf("Error in reading output of command %s from the nodes.\n", hops[0].cmd);
+    sprintf(err, "Error in reading output of command %s from the nodes.\n", hops[0].cmd);
+    status = -1;
+  }
+  return status;
+}
+
+/**
+ * @brief Sort the frames of a relayed broadcast: output goes to the buffer
+ * of the node it came from, the rest is collected as diagnostics
+ * 
+ * @param hdr 
+ * @param payload 
+ * @param arg relay_report
+ */
+void collectRelayed(struct frame_header *hdr, char *payload, void *arg)
+{
+  relay_report *relayed = (relay_report *)arg;
+  if (hdr->type != FRAME_DATA)
+    collectDiagnostics(hdr, payload, relayed->report);
+  else if (hdr->node > 0 && hdr->node <= MAX_CLIENTS_ALLOWED && relayed->index[hdr->node] != -1)
+    bufferAppend(&relayed->outputs[relayed->index[hdr->node]], payload, hdr->len < MAX_FRAME_PAYLOAD ? hdr->len : MAX_FRAME_PAYLOAD);
+}
+
+/**
+ * @brief Run one command on all the given nodes through a relay tree. The
+ * nodes are cut into fanout groups and the server contacts only the first
+ * node of each group, which relays the command to the rest of its group
+ * the same way (see handleRelay in clustershell_client). The server thus
+ * holds fanout connections whatever the size of the cluster, and the
+ * output of every node still comes back tagged with its node.
+ * 
+ * @param hops one hop per node
+ * @param count number of nodes
+ * @param fanout 
+ * @param input input of every node
+ * @param outputs buffer each node's output is collected in
+ * @param report collects stderr, failed exit statuses and node loads
+ * @param deadline nowMs() based deadline of the command pipe, 0 for none
+ * @param err set to an error message on failure
+ * @return int PUMPS_OK, PUMPS_TIMEOUT, or -1 on error
+ */
+int runRelayTree(struct hop *hops, int count, int fanout, struct buffer_list *input, struct buffer *outputs, chain_report *report, long long deadline, char *err)
+{
+  int roots = fanout < count ? fanout : count;
+  int nfds[roots];
+  struct pump pumps[2 * roots];
+  relay_report relayed = {.report = report, .outputs = outputs};
+  memset(relayed.index, -1, sizeof(relayed.index));
+  long long started = nowMs();
+  for (int i = 0; i < count; i++)
+    relayed.index[hops[i].node] = i;
+
+  for (int i = 0; i < roots; i++)
+  {
+    int start = i * count / roots;
+    int end = (i + 1) * count / roots;
+    if ((nfds[i] = openChain(&hops[start], 1, &hops[start + 1], end - start - 1, fanout, report->zip, err)) == -1)
+    {
+      while (i-- > 0)
+        close(nfds[i]);
+      return -1;
+    }
+    initChainPumps(&pumps[2 * i], nfds[i], input, -1, NULL, report);
+    pumps[2 * i + 1].demux = true;
+    pumps[2 * i + 1].on_frame = collectRelayed;
+    pumps[2 * i + 1].frame_arg = &relayed;
+  }
+  beginHops(hops, count, report);
+
+  int status = runPumps(pumps, 2 * roots, hopsDeadline(hops, count, deadline));
+
+  // the server only talks to the roots, the traffic of a group is theirs
+  size_t sent[count], received[count];
+  memset(sent, 0, sizeof(sent));
+  memset(received, 0, sizeof(received));
+  for (int i = 0; i < roots; i++)
+  {
+    close(nfds[i]);
+    sent[i * count / roots] = pumps[2 * i].bytes;
+    received[i * count / roots] = pumps[2 * i + 1].bytes;
+  }
+  recordHops(hops, count, report, started, sent, received, status);
+
+  if (status == PUMPS_OK || status == PUMPS_TIMEOUT)
+  {
+    reportMissing(hops, count, report, status);
+    if (status == PUMPS_TIMEOUT)
+      printf("-> Gave up on command %s, deadline exceeded\n", hops[0].cmd);
+  }
+  else
+  {
+    printf("Error in reading output of command %s from the relay tree.\n", hops[0].cmd);
+    sprintf(err, "Error in reading output of command %s from the relay tree.\n", hops[0].cmd);
+    status = -1;
+  }
+  return status;
+}
 
-        if (err)
+/**
+ * @brief Run a broadcast or partitioned command on all live nodes. A
+ * broadcast sends the whole input to every node. A partitioned command
+ * splits the input by lines (see partitionLines), nodes left without
+ * input are not run. The output of every node is added to output as a
+ * part of its own, in node order (which keeps the order of a split
+ * input), or the outputs are merged as sorted lines into one part.
+ * With a relay fanout set, a broadcast to more nodes than the fanout goes
+ * down a relay tree instead of the server contacting every node.
+ * 
+ * @param cmd 
+ * @param args 
+ * @param input 
+ * @param output list the outputs are added to
+ * @param report 
+ * @param deadline nowMs() based deadline of the command pipe, 0 for none
+ * @param err set to an error message on failure, of MAX_OUTPUT_SIZE + 1
+ * bytes
+ */
+void runBroadcast(struct command *cmd, arg_struct *args, struct buffer_list *input, struct buffer_list *output, chain_report *report, long long deadline, char *err)
+{
+  parsed_config *config = args->config;
+  struct hop hops[MAX_CLIENTS_ALLOWED];
+  struct buffer parts[MAX_CLIENTS_ALLOWED];
+  struct buffer_list part_lists[MAX_CLIENTS_ALLOWED];
+  struct buffer_list *inputs[MAX_CLIENTS_ALLOWED];
+  struct buffer outputs[MAX_CLIENTS_ALLOWED];
+  int count = 0;
+
+  for (int i = 0; i < config->count; i++)
+  {
+    if (args->active_connections[i] == false || args->loads[i].alive == false)
+    {
+      continue;
+    }
+    struct hop hop = {i + 1, config->data[i], args->connection_ports[i], cmd->timeout_ms, cmd->cmd, machinePath(args, i)};
+    hops[count++] = hop;
+  }
+  if (count == 0)
+  {
+    printf("No machine is alive to run command %s.\n", cmd->cmd);
+    snprintf(err, MAX_OUTPUT_SIZE + 1, "No machine is alive to run command %s.\n", cmd->cmd);
+    return;
+  }
+
+  if (cmd->partition != PARTITION_NONE)
+    partitionLines(input, cmd->partition, parts, count);
+
+  int run = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (cmd->partition != PARTITION_NONE && parts[i].len == 0)
+      continue;
+    hops[run] = hops[i];
+    inputs[run] = input;
+    if (cmd->partition != PARTITION_NONE)
+    {
+      bufferListInit(&part_lists[run]);
+      bufferListAdd(&part_lists[run], 0, &parts[i]);
+      inputs[run] = &part_lists[run];
+    }
+    bufferInit(&outputs[run]);
+    run++;
+  }
+
+  // nodes with a cached output are not contacted at all
+  struct hop miss_hops[MAX_CLIENTS_ALLOWED];
+  struct buffer_list *miss_inputs[MAX_CLIENTS_ALLOWED];
+  struct buffer miss_outputs[MAX_CLIENTS_ALLOWED];
+  int missed[MAX_CLIENTS_ALLOWED];
+  int miss_count = 0;
+  bool use_cache = args->cache_on && !isChangeDir(cmd->cmd);
+  for (int i = 0; i < run; i++)
+  {
+    if (isChangeDir(cmd->cmd))
+      cacheInvalidate(hops[i].node);
+    if (use_cache && cacheLookup(&hops[i], 1, inputs[i], &outputs[i]))
+    {
+      printf("-> Cached output of command %s on machine n%d\n", cmd->cmd, hops[i].node);
+      continue;
+    }
+    printf("-> Running command %s on machine n%d (%s:%d)\n", cmd->cmd, hops[i].node, hops[i].ip, hops[i].port);
+    missed[miss_count] = i;
+    miss_hops[miss_count] = hops[i];
+    miss_inputs[miss_count] = inputs[i];
+    bufferInit(&miss_outputs[miss_count]);
+    miss_count++;
+  }
+
+  int status;
+  if (cmd->partition == PARTITION_NONE && args->relay_fanout > 0 && miss_count > args->relay_fanout)
+    status = runRelayTree(miss_hops, miss_count, args->relay_fanout, input, miss_outputs, report, deadline, err);
+  else
+    status = runFanout(miss_hops, miss_count, miss_inputs, miss_outputs, report, deadline, err);
+
+  for (int i = 0; i < miss_count; i++)
+  {
+    int node = miss_hops[i].node;
+    if (use_cache && status == PUMPS_OK && report->reported[node] && !report->failed[node])
+      cacheStore(&miss_hops[i], 1, miss_inputs[i], &miss_outputs[i], args->cache_ttl_ms);
+    outputs[missed[i]] = miss_outputs[i];
+  }
+
+  if (status != -1)
+  {
+    if (cmd->sort_merge)
+    {
+      struct buffer merged;
+      bufferInit(&merged);
+      mergeSortedLines(outputs, run, &merged);
+      bufferListAdd(output, 0, &merged);
+    }
+    else
+      for (int i = 0; i < run; i++)
+        bufferListAdd(output, hops[i].node, &outputs[i]);
+  }
+
+  for (int i = 0; i < run; i++)
+    bufferFree(&outputs[i]);
+  for (int i = 0; i < run && cmd->partition != PARTITION_NONE; i++)
+    bufferListFree(&part_lists[i]);
+  for (int i = 0; i < count && cmd->partition != PARTITION_NONE; i++)
+    bufferFree(&parts[i]);
+}
+
+/**
+ * @brief Run the command pipe and write its output to out_fd (the client,
+ * or the spool file of a background job), followed by the stderr, failed
+ * exit statuses and timeouts of its commands.
+ * The output of a stage is kept as a list of parts, one per node of a
+ * broadcast, which is fed to the next stage or written out with writev
+ * as it is, without copying the parts together.
+ * Consecutive commands that are not broadcasts are run as one chain, the
+ * data flows between their nodes without passing through the server. The
+ * output of a broadcast (or partitioned command) has to be gathered from
+ * every node, so it is held on the server and sent as input to whatever
+ * comes next.
+ * Once a command times out or is cancelled no further commands are run,
+ * and the partial output gathered so far is returned.
+ * 
+ * @param cmd_pipe 
+ * @param args 
+ * @param idx index of the machine the request came from
+ * @param out_fd 
+ * @param terminate end the output with a null character
+ */
+void runCommandPipe(struct command_pipe *cmd_pipe, arg_struct *args, int idx, int out_fd, bool terminate)
+{
+  parsed_config *config = args->config;
+  int *connection_ports = args->connection_ports;
+
+  struct command *curr_cmd = cmd_pipe->head;
+  struct buffer_list output;
+  bufferListInit(&output);
+  struct buffer diag;
+  bufferInit(&diag);
+  chain_report report = {.diag = &diag, .loads = args->loads};
+  report.zip = args->zip;
+  char err[MAX_OUTPUT_SIZE + 1] = "";
+  bool streamed = false;
+  long long started = nowMs();
+  long long deadline = args->timeout_ms > 0 ? started + args->timeout_ms : 0;
+
+  while (curr_cmd && err[0] == '\0' && !report.stopped)
+  {
+    struct buffer_list next_output;
+    bufferListInit(&next_output);
+
+    if (curr_cmd->machine == 0)
+    { // broadcast or partitioned command
+
+      runBroadcast(curr_cmd, args, &output, &next_output, &report, deadline, err);
+      curr_cmd = curr_cmd->next;
+    }
+    else
+    {
+      /** ---- It is not a broadcast, extend the chain as far as possible ---- **/
+
+      struct hop hops[MAX_HOPS];
+      int machines[MAX_HOPS];
+      int count = 0;
+      while (curr_cmd && curr_cmd->machine != 0 && count < MAX_HOPS)
+      {
+        int machine = resolveMachine(curr_cmd, args, idx, machines, count, err);
+        if (machine == -1)
           break;
 
-        strcpy(output, res);
+        // a chain holding a worker on a machine must not wait for another
+        // worker on it, that deadlocks once the machine's workers are all
+        // busy. Start a new chain from the server instead.
+        bool repeated = false;
+        for (int i = 0; i < count; i++)
+          repeated = repeated || machines[i] == machine;
+        if (repeated)
+          break;
+        machines[count] = machine;
+
+        if (isChangeDir(curr_cmd->cmd))
+          cacheInvalidate(machine + 1);
+        printf("-> Running command %s on machine n%d (%s:%d)\n", curr_cmd->cmd, machine + 1, config->data[machine], connection_ports[machine]);
+        hops[count].node = machine + 1;
+        hops[count].ip = config->data[machine];
+        hops[count].port = connection_ports[machine];
+        hops[count].path = machinePath(args, machine);
+        hops[count].timeout_ms = curr_cmd->timeout_ms;
+        hops[count].cmd = curr_cmd->cmd;
+        count++;
         curr_cmd = curr_cmd->next;
-        continue;
       }
 
-      /** ---- It is not a broadcast ---- **/
+      bool use_cache = args->cache_on && err[0] == '\0';
+      for (int i = 0; i < count && use_cache; i++)
+        use_cache = !isChangeDir(hops[i].cmd);
 
-      int machine = curr_cmd->machine;
-      if (machine == -1)
-      { // run on same machine from which request came
-        machine = idx;
-      }
-      else
+      struct buffer chain_output;
+      bufferInit(&chain_output);
+      if (use_cache && cacheLookup(hops, count, &output, &chain_output))
       {
-        machine -= 1; // since it is used as array index
+        printf("-> Cached output of the chain starting with command %s on machine n%d\n", hops[0].cmd, hops[0].node);
       }
-
-      if (machine >= config->count)
+      else if (err[0] == '\0')
       {
-        printf("Invalid machine name found: n%d. Please verify that it exists in config in correct order.\n", machine + 1);
-        err = true;
-        sprintf(output, "Invalid machine name found: n%d. Please verify that it exists in config in correct order.\n", machine + 1);
-        break;
-      }
+        // output of the last chain is streamed straight to the client,
+        // unless it has to be kept for the cache
+        streamed = curr_cmd == NULL && !use_cache;
+        int status = runChain(hops, count, &output, streamed ? out_fd : -1, &chain_output, &report, deadline, err);
 
-      if (active_connections[machine] == false)
-      {
-        printf("Machine n%d is not connected.", machine + 1);
-        err = true;
-        sprintf(output, "Machine n%d is not connected.", machine + 1);
-        break;
+        bool succeeded = use_cache && status == PUMPS_OK;
+        for (int i = 0; i < count && succeeded; i++)
+          succeeded = report.reported[hops[i].node] && !report.failed[hops[i].node];
+        if (succeeded)
+          cacheStore(hops, count, &output, &chain_output, args->cache_ttl_ms);
       }
+      bufferListAdd(&next_output, count > 0 ? hops[count - 1].node : 0, &chain_output);
+    }
 
-      printf("-> Running command %s on machine n%d (%s:%d)\n", curr_cmd->cmd, machine + 1, config->data[machine], connection_ports[machine]);
-      int cfd_client = clientSetup(config->data[machine], connection_ports[machine], sfd); // act as a client and send request to the machine
-      int cmd_len = strlen(curr_cmd->cmd);
+    bufferListFree(&output);
+    output = next_output;
+  }
 
-      // send command to server (clustershell_client)
-      char input[MAX_COMMAND_SIZE + 1 + MAX_OUTPUT_SIZE + 1];
-      strcpy(input, curr_cmd->cmd);                      // copy the command to input array
-      input[strlen(curr_cmd->cmd)] = '\0';               // a \0 (null) separater between the command and input to the command
-      strcpy(input + strlen(curr_cmd->cmd) + 1, output); // copy the previous output which will hence be the input to this command
+  // write final output, followed by the stderr, failed exit statuses and
+  // timeouts of all the commands, in a single writev
+  bool failed = err[0] != '\0' || diag.len > 0;
+  if (err[0] != '\0' || streamed)
+    bufferListFree(&output);
+  if (err[0] != '\0')
+    bufferListAppend(&output, 0, err, strlen(err));
+  bufferListAdd(&output, 0, &diag);
+  if (terminate)
+    bufferListAppend(&output, 0, "", 1);
+  writeBufferList(out_fd, &output);
 
-      int sz = strlen(input) + 1 + strlen(output) + 1;
-      int write_num = write(cfd_client, input, sz);
-      if (write_num != sz)
-      {
-        printf("Error in writing command %s to machine n%d.\n", curr_cmd->cmd, machine + 1);
-        err = true;
-        sprintf(output, "Error in writing command %s to machine n%d.\n", curr_cmd->cmd, machine + 1);
-        break;
-      }
+  statsCommandDone(&args->stats, nowMs() - started, report.sent, report.received, failed);
 
-      // read output of command from server (clustershell_client)
-      output_read_num = read(cfd_client, output, MAX_OUTPUT_SIZE);
-      if (output_read_num == -1)
-      {
-        printf("Error in reading output of command %s from machine n%d.\n", curr_cmd->cmd, machine + 1);
-        err = true;
-        sprintf(output, "Error in reading output of command %s from machine n%d.\n", curr_cmd->cmd, machine + 1);
-        break;
-      }
-      output[output_read_num] = '\0';
+  bufferListFree(&output);
+}
 
-      close(cfd_client);
-      curr_cmd = curr_cmd->next;
+/**
+ * @brief Check if the command should run in the background, ie. ends with
+ * a & (but not &&). The & is removed.
+ * 
+ * @param cmd 
+ * @return true 
+ * @return false 
+ */
+bool isBackground(char *cmd)
+{
+  int len = strlen(cmd);
+  while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\n'))
+    len--;
+  if (len < 2 || cmd[len - 1] != '&' || cmd[len - 2] == '&')
+    return false;
+  len--;
+  while (len > 0 && cmd[len - 1] == ' ')
+    len--;
+  cmd[len] = '\0';
+  return true;
+}
+
+/**
+ * @brief Run a background job, then keep its result in memory if it is
+ * small enough or on disk otherwise
+ * 
+ * @param arg job
+ * @return void* 
+ */
+void *jobHandler(void *arg)
+{
+  job *j = (job *)arg;
+  runCommandPipe(j->cmd_pipe, j->args, j->idx, j->spool_fd, false);
+  resetCommandPipe(j->cmd_pipe);
+  free(j->cmd_pipe);
+  free(j->text);
+
+  size_t size = lseek(j->spool_fd, 0, SEEK_END);
+  if (size <= JOB_MEMORY_LIMIT)
+  {
+    char chunk[PUMP_CHUNK_SIZE];
+    ssize_t n;
+    lseek(j->spool_fd, 0, SEEK_SET);
+    while ((n = read(j->spool_fd, chunk, sizeof(chunk))) > 0)
+      bufferAppend(&j->result, chunk, n);
+    close(j->spool_fd);
+    unlink(j->spool_path);
+    j->spool_fd = -1;
+  }
+  printf("-> Job %d (%s) done, %zu bytes of output\n", j->id, j->cmd, size);
+
+  arg_struct *args = j->args;
+  pthread_mutex_lock(&args->jobs_lock);
+  j->size = size;
+  j->finished = nowMs();
+  j->done = true;
+  if (args->closed)
+  { // nobody is left to fetch the result
+    job **link = &args->jobs;
+    while (*link != j)
+      link = &(*link)->next;
+    *link = j->next;
+    args->job_count--;
+    freeJob(j);
+  }
+  pthread_cond_broadcast(&args->jobs_cond);
+  pthread_mutex_unlock(&args->jobs_lock);
+  return NULL;
+}
+
+/**
+ * @brief Start a background job running the command and write the job id
+ * (or why the job could not be started) to res
+ * 
+ * @param cmd 
+ * @param args 
+ * @param idx index of the machine the request came from
+ * @param res 
+ * @param size size of res
+ * @return int job id, or -1 on error
+ */
+int startJob(char *cmd, arg_struct *args, int idx, char *res, size_t size)
+{
+  pthread_mutex_lock(&args->jobs_lock);
+  int job_count = args->job_count;
+  pthread_mutex_unlock(&args->jobs_lock);
+  if (job_count >= MAX_JOBS)
+  {
+    snprintf(res, size, "Too many jobs (%d), fetch some results first.\n", job_count);
+    return -1;
+  }
+
+  job *j = (job *)calloc(1, sizeof(job));
+  assert(j != NULL, "calloc error while creating job", -1, -1);
+  strcpy(j->spool_path, JOB_SPOOL_TEMPLATE);
+  if ((j->spool_fd = mkstemp(j->spool_path)) == -1)
+  {
+    snprintf(res, size, "Could not create a spool file for the job.\n");
+    free(j);
+    return -1;
+  }
+  fcntl(j->spool_fd, F_SETFD, FD_CLOEXEC);
+
+  j->cmd = strdup(cmd);
+  j->text = strdup(cmd);
+  j->args = args;
+  j->idx = idx;
+  j->started = nowMs();
+  bufferInit(&j->result);
+  j->cmd_pipe = initCommandPipe();
+  createCommandPipe(j->text, j->cmd_pipe);
+  planCommandPipe(j->cmd_pipe, idx + 1);
+
+  pthread_mutex_lock(&args->jobs_lock);
+  j->id = ++args->next_job_id;
+  j->next = args->jobs;
+  args->jobs = j;
+  args->job_count++;
+  pthread_mutex_unlock(&args->jobs_lock);
+
+  pthread_t thread_id;
+  assert(pthread_create(&thread_id, NULL, jobHandler, (void *)j) == 0, "pthread_create error", -1, -1);
+  pthread_detach(thread_id);
+
+  printf("-> Job %d started: %s\n", j->id, j->cmd);
+  snprintf(res, size, "[%d] %s\n", j->id, j->cmd);
+  return j->id;
+}
+
+/**
+ * @brief List the jobs of the session
+ * 
+ * @param args 
+ * @param res 
+ * @param size 
+ */
+void listJobs(arg_struct *args, char *res, int size)
+{
+  int offset = 0;
+  res[0] = '\0';
+  pthread_mutex_lock(&args->jobs_lock);
+  for (job *j = args->jobs; j && offset < size - 1; j = j->next)
+  {
+    long long elapsed = (j->done ? j->finished : nowMs()) - j->started;
+    if (j->done)
+      offset += snprintf(res + offset, size - offset, "[%d] done (%lldms, %zu bytes) %s\n", j->id, elapsed, j->size, j->cmd);
+    else
+      offset += snprintf(res + offset, size - offset, "[%d] running (%lldms) %s\n", j->id, elapsed, j->cmd);
+  }
+  pthread_mutex_unlock(&args->jobs_lock);
+  if (offset == 0)
+    snprintf(res, size, "No jobs.\n");
+}
+
+/**
+ * @brief Free a finished job and remove its spool file
+ * 
+ * @param j 
+ */
+void freeJob(job *j)
+{
+  if (j->spool_fd != -1)
+  {
+    close(j->spool_fd);
+    unlink(j->spool_path);
+  }
+  bufferFree(&j->result);
+  free(j->cmd);
+  free(j);
+}
+
+/**
+ * @brief Drop the jobs of a session whose client has gone. Finished jobs
+ * are freed here, running ones free themselves when they finish.
+ * 
+ * @param args 
+ */
+void dropJobs(arg_struct *args)
+{
+  pthread_mutex_lock(&args->jobs_lock);
+  args->closed = true;
+  job **link = &args->jobs;
+  while (*link)
+  {
+    job *j = *link;
+    if (j->done)
+    {
+      *link = j->next;
+      args->job_count--;
+      freeJob(j);
     }
+    else
+      link = &j->next;
+  }
+  pthread_mutex_unlock(&args->jobs_lock);
+}
+
+/**
+ * @brief Send the result of a job to the client, followed by a null
+ * character. The job is forgotten once its result is sent.
+ * 
+ * @param args 
+ * @param id 
+ * @param wait wait for the job to finish, instead of failing if it runs
+ */
+void sendJobResult(arg_struct *args, int id, bool wait)
+{
+  int cfd = args->cfd;
+  char res[MAX_OUTPUT_SIZE + 1];
 
-    // write final output to the client we got input from
-    write(cfd, output, strlen(output) + 1);
+  pthread_mutex_lock(&args->jobs_lock);
+  job **link = &args->jobs;
+  while (*link && (*link)->id != id)
+    link = &(*link)->next;
+  job *j = *link;
+  while (j && wait && !j->done)
+    pthread_cond_wait(&args->jobs_cond, &args->jobs_lock);
+  if (j && j->done)
+  {
+    // the list may have changed while waiting
+    for (link = &args->jobs; *link != j; link = &(*link)->next)
+      ;
+    *link = j->next;
+    args->job_count--;
+  }
+  pthread_mutex_unlock(&args->jobs_lock);
 
-    // TO DO: Check for background command?
-    resetCommandPipe(cmd_pipe);
+  if (j == NULL)
+  {
+    sprintf(res, "No job %d.\n", id);
+    write(cfd, res, strlen(res) + 1);
+    return;
+  }
+  if (!j->done)
+  {
+    sprintf(res, "Job %d is still running, use wait %d to wait for it.\n", id, id);
+    write(cfd, res, strlen(res) + 1);
+    return;
   }
 
-  active_connections[idx] = false;
-  close(cfd);
+  if (j->spool_fd == -1)
+  {
+    writeAll(cfd, j->result.data ? j->result.data : "", j->result.len);
+  }
+  else
+  { // large result, send it from the spool file
+    char chunk[PUMP_CHUNK_SIZE];
+    ssize_t n;
+    lseek(j->spool_fd, 0, SEEK_SET);
+    while ((n = read(j->spool_fd, chunk, sizeof(chunk))) > 0 && writeAll(cfd, chunk, n) == 0)
+      ;
+  }
+  writeAll(cfd, "", 1);
+  freeJob(j);
+}
+
+/**
+ * @brief Run a cache built-in command and write its reply to res:
+ * "cache" shows the settings of the session, "cache on|off" turns the
+ * cache on or off for the session, "cache ttl <duration>" sets how long
+ * results of the session are kept, "cache clear [n<id>]" drops the cached
+ * results (of a node) and "cache stats" shows the counters of the cache.
+ * 
+ * @param args 
+ * @param arg what follows "cache"
+ * @param res 
+ * @param size size of res
+ */
+void cacheCommand(arg_struct *args, char *arg, char *res, size_t size)
+{
+  while (*arg == ' ')
+    arg++;
+
+  if (*arg == '\0')
+  {
+    snprintf(res, size, "cache: %s, ttl %dms\n", args->cache_on ? "on" : "off", args->cache_ttl_ms);
+  }
+  else if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+  {
+    args->cache_on = arg[1] == 'n';
+    snprintf(res, size, "cache %s\n", arg);
+  }
+  else if (strncmp(arg, "ttl ", 4) == 0)
+  {
+    int ttl_ms = parseDuration(arg + 4);
+    if (ttl_ms <= 0)
+      snprintf(res, size, "Invalid ttl %s, use eg: cache ttl 30s\n", arg + 4);
+    else
+    {
+      args->cache_ttl_ms = ttl_ms;
+      snprintf(res, size, "cache ttl set to %dms\n", ttl_ms);
+    }
+  }
+  else if (strncmp(arg, "clear", 5) == 0)
+  {
+    char *node = arg + 5;
+    while (*node == ' ')
+      node++;
+    if (*node != '\0' && (node[0] != 'n' || atoi(node + 1) <= 0))
+      snprintf(res, size, "Invalid machine %s, use eg: cache clear n2\n", node);
+    else
+      snprintf(res, size, "%d cached results dropped\n", cacheInvalidate(*node ? atoi(node + 1) : 0));
+  }
+  else if (strcmp(arg, "stats") == 0)
+  {
+    struct cache_stats stats;
+    cacheGetStats(&stats);
+    long lookups = stats.hits + stats.misses;
+    snprintf(res, size, "hits=%ld misses=%ld hit_rate=%.1f%% entries=%ld size=%zu stores=%ld evictions=%ld\n", stats.hits, stats.misses,
+            lookups ? 100.0 * stats.hits / lookups : 0.0, stats.entries, stats.size, stats.stores, stats.evictions);
+  }
+  else
+  {
+    snprintf(res, size, "Usage: cache [on|off|ttl <duration>|clear [n<id>]|stats]\n");
+  }
+}
+
+/**
+ * @brief Print the stats of the nodes and of the server every interval
+ * 
+ * @param args pointer to the interval in seconds
+ * @return void* 
+ */
+void *statsHandler(void *args)
+{
+  int interval = *(int *)args;
+  for (;;)
+  {
+    sleep(interval);
+    struct buffer report;
+    bufferInit(&report);
+    statsReport(NULL, &report);
+    printf("\n~ Stats ~\n%.*s", (int)report.len, report.data);
+    fflush(stdout);
+    bufferFree(&report);
+  }
   return NULL;
-}
\ No newline at end of file
+}
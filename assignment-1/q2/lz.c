@@ -0,0 +1,207 @@
+#include "lz.h"
+
+/**
+ * @brief Read 4 bytes as an integer, whatever their alignment
+ * 
+ * @param p 
+ * @return uint32_t
+ */
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/**
+ * @brief Hash of the 4 bytes starting a possible match
+ * 
+ * @param v 
+ * @return int 
+ */
+static int hash32(uint32_t v)
+{
+  return (int)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/**
+ * @brief Write a length that did not fit in its nibble as bytes of 255
+ * followed by the rest
+ * 
+ * @param out 
+ * @param end 
+ * @param len what is left of the length
+ * @return unsigned char* position after the length, NULL if dst is full
+ */
+static unsigned char *writeLength(unsigned char *out, unsigned char *end, int len)
+{
+  for (; len >= 255; len -= 255)
+  {
+    if (out == end)
+      return NULL;
+    *out++ = 255;
+  }
+  if (out == end)
+    return NULL;
+  *out++ = (unsigned char)len;
+  return out;
+}
+
+/**
+ * @brief Write a sequence: its literals and a match (none if match_len is 0)
+ * 
+ * @param out 
+ * @param end 
+ * @param literals 
+ * @param literal_len 
+ * @param offset 
+ * @param match_len 
+ * @return unsigned char* position after the sequence, NULL if dst is full
+ */
+static unsigned char *writeSequence(unsigned char *out, unsigned char *end, const unsigned char *literals, int literal_len,
+                                    int offset, int match_len)
+{
+  int match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+  if (out == end)
+    return NULL;
+  unsigned char *token = out++;
+  *token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15));
+  if (literal_len >= 15 && (out = writeLength(out, end, literal_len - 15)) == NULL)
+    return NULL;
+  if (end - out < literal_len)
+    return NULL;
+  memcpy(out, literals, literal_len);
+  out += literal_len;
+  if (match_len == 0)
+    return out;
+
+  if (end - out < 2)
+    return NULL;
+  *out++ = (unsigned char)(offset & 0xff);
+  *out++ = (unsigned char)(offset >> 8);
+  if (match_code >= 15 && (out = writeLength(out, end, match_code - 15)) == NULL)
+    return NULL;
+  return out;
+}
+
+/**
+ * @brief Compress src into dst. Matches are found through a table of the
+ * last position each 4 byte hash was seen at, which is fast and does well
+ * on text.
+ * 
+ * @param src 
+ * @param len at most LZ_MAX_INPUT bytes
+ * @param dst 
+ * @param cap size of dst
+ * @return int size of the compressed data, -1 if it does not fit in cap
+ */
+int lzCompress(const char *src, int len, char *dst, int cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  unsigned char *end = out + cap;
+  uint16_t table[1 << LZ_HASH_BITS]; // position + 1, 0 for none
+  memset(table, 0, sizeof(table));
+
+  if (len > LZ_MAX_INPUT)
+    return -1;
+
+  int anchor = 0;
+  int i = 0;
+  while (i + LZ_MIN_MATCH <= len)
+  {
+    uint32_t seq = read32(in + i);
+    int h = hash32(seq);
+    int candidate = table[h] - 1;
+    table[h] = (uint16_t)(i + 1);
+    if (candidate < 0 || read32(in + candidate) != seq)
+    {
+      i++;
+      continue;
+    }
+
+    int match_len = LZ_MIN_MATCH;
+    while (i + match_len < len && in[candidate + match_len] == in[i + match_len])
+      match_len++;
+    if ((out = writeSequence(out, end, in + anchor, i - anchor, i - candidate, match_len)) == NULL)
+      return -1;
+    i += match_len;
+    anchor = i;
+  }
+
+  if (anchor < len && (out = writeSequence(out, end, in + anchor, len - anchor, 0, 0)) == NULL)
+    return -1;
+  return (int)(out - (unsigned char *)dst);
+}
+
+/**
+ * @brief Read a length continued in bytes of 255 (see writeLength)
+ * 
+ * @param in 
+ * @param end 
+ * @param len the nibble, the bytes are added to it
+ * @return const unsigned char* position after the length, NULL if src ends
+ */
+static const unsigned char *readLength(const unsigned char *in, const unsigned char *end, int *len)
+{
+  unsigned char b;
+  do
+  {
+    if (in == end)
+      return NULL;
+    b = *in++;
+    *len += b;
+  } while (b == 255);
+  return in;
+}
+
+/**
+ * @brief Decompress src into dst, checking every length and offset so that
+ * corrupt data is caught instead of overflowing dst
+ * 
+ * @param src 
+ * @param len 
+ * @param dst 
+ * @param cap size of dst
+ * @return int size of the decompressed data, -1 if src is corrupt or does
+ * not fit in cap
+ */
+int lzDecompress(const char *src, int len, char *dst, int cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *in_end = in + len;
+  unsigned char *out = (unsigned char *)dst;
+  unsigned char *out_end = out + cap;
+
+  while (in < in_end)
+  {
+    int token = *in++;
+    int literal_len = token >> 4;
+    if (literal_len == 15 && (in = readLength(in, in_end, &literal_len)) == NULL)
+      return -1;
+    if (in_end - in < literal_len || out_end - out < literal_len)
+      return -1;
+    memcpy(out, in, literal_len);
+    in += literal_len;
+    out += literal_len;
+    if (in == in_end)
+      break; // the last sequence has no match
+
+    if (in_end - in < 2)
+      return -1;
+    int offset = in[0] | in[1] << 8;
+    in += 2;
+    int match_len = token & 15;
+    if (match_len == 15 && (in = readLength(in, in_end, &match_len)) == NULL)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out - (unsigned char *)dst || out_end - out < match_len)
+      return -1;
+
+    // byte by byte, a match may overlap the bytes it produces
+    const unsigned char *from = out - offset;
+    for (int i = 0; i < match_len; i++)
+      *out++ = from[i];
+  }
+  return (int)(out - (unsigned char *)dst);
+}
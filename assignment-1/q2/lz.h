@@ -0,0 +1,22 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+// A small LZ77 codec for the output frames of nodes. The input is cut into
+// sequences of literals followed by a match (a copy of earlier bytes):
+// a token byte holds the literal count (high nibble) and the match length
+// minus LZ_MIN_MATCH (low nibble), 15 meaning more length bytes follow
+// (each adding up to 255). Then come the literals, the match offset (2
+// bytes, little endian) and the extra match length bytes. The last
+// sequence only has literals.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_INPUT 65535 // offsets and positions fit in 16 bits
+
+int lzCompress(const char *src, int len, char *dst, int cap);
+
+int lzDecompress(const char *src, int len, char *dst, int cap);
+
+#endif
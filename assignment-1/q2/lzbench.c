@@ -0,0 +1,139 @@
+#include "./utils.h"
+
+#define LZBENCH_MIN_SECONDS 0.5 // each file is run through the codec at least this long
+
+/**
+ * @brief Seconds of a monotonic clock
+ * 
+ * @return double 
+ */
+double nowSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Read a whole file
+ * 
+ * @param path 
+ * @param buf 
+ * @return int 0 on success, -1 on error
+ */
+int readFile(char *path, struct buffer *buf)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  char chunk[PUMP_CHUNK_SIZE];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    bufferAppend(buf, chunk, n);
+  fclose(f);
+  return 0;
+}
+
+/**
+ * @brief Compress the data in frames the way an encoding pump does, each
+ * frame on its own, and keep them (length, then payload) in packed.
+ * Frames that do not get smaller are kept as they are.
+ * 
+ * @param data 
+ * @param packed 
+ */
+void packFrames(struct buffer *data, struct buffer *packed)
+{
+  char frame[MAX_FRAME_PAYLOAD];
+  packed->len = 0;
+  for (size_t off = 0; off < data->len; off += MAX_FRAME_PAYLOAD)
+  {
+    int len = data->len - off < MAX_FRAME_PAYLOAD ? data->len - off : MAX_FRAME_PAYLOAD;
+    int packed_len = lzCompress(data->data + off, len, frame, len - 1);
+    int header = packed_len == -1 ? -len : packed_len; // negative: stored as is
+    bufferAppend(packed, (char *)&header, sizeof(header));
+    bufferAppend(packed, packed_len == -1 ? data->data + off : frame, packed_len == -1 ? len : packed_len);
+  }
+}
+
+/**
+ * @brief Expand the frames of packFrames into data
+ * 
+ * @param packed 
+ * @param data 
+ * @return int 0 on success, -1 if a frame does not expand
+ */
+int unpackFrames(struct buffer *packed, struct buffer *data)
+{
+  char frame[MAX_FRAME_PAYLOAD];
+  data->len = 0;
+  for (size_t off = 0; off < packed->len;)
+  {
+    int header;
+    memcpy(&header, packed->data + off, sizeof(header));
+    off += sizeof(header);
+    if (header < 0)
+    {
+      bufferAppend(data, packed->data + off, -header);
+      off += -header;
+      continue;
+    }
+    int len = lzDecompress(packed->data + off, header, frame, sizeof(frame));
+    if (len == -1)
+      return -1;
+    bufferAppend(data, frame, len);
+    off += header;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    errExit("\nUsage: lzbench.out <FILE>...\n", -1, -1);
+  }
+
+  printf("%-30s %10s %10s %7s %10s %10s\n", "file", "size", "packed", "ratio", "comp MB/s", "dec MB/s");
+  for (int i = 1; i < argc; i++)
+  {
+    struct buffer data, packed, check;
+    bufferInit(&data);
+    bufferInit(&packed);
+    bufferInit(&check);
+    if (readFile(argv[i], &data) == -1 || data.len == 0)
+    {
+      printf("%-30s could not be read or is empty\n", argv[i]);
+      continue;
+    }
+
+    int rounds = 0;
+    double start = nowSeconds(), elapsed;
+    do
+    {
+      packFrames(&data, &packed);
+      rounds++;
+    } while ((elapsed = nowSeconds() - start) < LZBENCH_MIN_SECONDS);
+    double comp = data.len * (double)rounds / elapsed / (1024 * 1024);
+
+    rounds = 0;
+    start = nowSeconds();
+    do
+    {
+      if (unpackFrames(&packed, &check) == -1)
+        break;
+      rounds++;
+    } while ((elapsed = nowSeconds() - start) < LZBENCH_MIN_SECONDS);
+    double dec = data.len * (double)rounds / elapsed / (1024 * 1024);
+
+    if (check.len != data.len || memcmp(check.data, data.data, data.len) != 0)
+      printf("%-30s round trip FAILED\n", argv[i]);
+    else
+      printf("%-30s %10zu %10zu %6.2fx %10.1f %10.1f\n", argv[i], data.len, packed.len, (double)data.len / packed.len, comp, dec);
+
+    bufferFree(&data);
+    bufferFree(&packed);
+    bufferFree(&check);
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "./utils.h"
+
+/**
+ * @brief Split lines of numbers into count parts and check that every part
+ * gets its share, give or take a line, and that no line is lost
+ * 
+ * @param lines 
+ * @param count 
+ * @param chunks number of buffers the input comes in, as from several nodes
+ * @return int 0 if the parts are balanced, -1 otherwise
+ */
+int checkSplit(int lines, int count, int chunks)
+{
+  struct buffer_list input;
+  bufferListInit(&input);
+  for (int c = 0; c < chunks; c++)
+  {
+    struct buffer data;
+    bufferInit(&data);
+    for (int i = c * lines / chunks; i < (c + 1) * lines / chunks; i++)
+    {
+      char line[32];
+      int len = sprintf(line, "%d\n", i);
+      bufferAppend(&data, line, len);
+    }
+    bufferListAdd(&input, c, &data);
+  }
+
+  struct buffer parts[count];
+  partitionLines(&input, PARTITION_SPLIT, parts, count);
+
+  int failed = 0;
+  size_t total = 0;
+  size_t share = input.len / count;
+  for (int i = 0; i < count; i++)
+  {
+    total += parts[i].len;
+    // a part may run over its share by up to a line
+    if (parts[i].len + 16 < share || parts[i].len > share + 16)
+      failed = 1;
+  }
+  if (total != input.len)
+    failed = 1;
+
+  printf("%s: %d lines in %d chunks into %d parts:", failed ? "FAIL" : "ok", lines, chunks, count);
+  for (int i = 0; i < count; i++)
+    printf(" %zu", parts[i].len);
+  printf("\n");
+
+  for (int i = 0; i < count; i++)
+    bufferFree(&parts[i]);
+  bufferListFree(&input);
+  return failed ? -1 : 0;
+}
+
+int main()
+{
+  int failed = 0;
+  int counts[] = {1, 2, 3, 4, 8};
+  for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++)
+  {
+    failed |= checkSplit(200000, counts[i], 1);
+    failed |= checkSplit(200000, counts[i], 3);
+  }
+  return failed ? 1 : 0;
+}
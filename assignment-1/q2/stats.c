@@ -0,0 +1,224 @@
+#include "stats.h"
+
+// counters of every node and of all commands run by the server, guarded by
+// stats_lock (which also guards the counters of the sessions)
+static struct node_stats nodes[MAX_CLIENTS_ALLOWED + 1];
+static struct session_stats server_totals;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Bucket of a latency
+ * 
+ * @param ms 
+ * @return int 
+ */
+static int latencyBucket(long long ms)
+{
+  if (ms < 4)
+    return ms < 0 ? 0 : (int)ms;
+  int exp = 63 - __builtin_clzll((unsigned long long)ms);
+  int bucket = 4 + (exp - 2) * 4 + (int)((ms >> (exp - 2)) & 3);
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @brief Largest latency counted in a bucket
+ * 
+ * @param bucket 
+ * @return long long 
+ */
+static long long bucketLimit(int bucket)
+{
+  if (bucket < 4)
+    return bucket;
+  int exp = (bucket - 4) / 4 + 2;
+  long long step = 1LL << (exp - 2);
+  return (1LL << exp) + ((bucket - 4) % 4 + 1) * step - 1;
+}
+
+/**
+ * @brief Add a latency to the histogram
+ * 
+ * @param hist 
+ * @param ms 
+ */
+static void addLatency(struct latency_histogram *hist, long long ms)
+{
+  hist->counts[latencyBucket(ms)]++;
+  hist->total++;
+  hist->sum_ms += ms;
+  if (ms > hist->max_ms)
+    hist->max_ms = ms;
+}
+
+/**
+ * @brief Latency below which the given fraction of the latencies fall, to
+ * the resolution of the buckets
+ * 
+ * @param hist 
+ * @param fraction eg: 0.99
+ * @return long long 
+ */
+static long long percentile(struct latency_histogram *hist, double fraction)
+{
+  long rank = (long)ceil(fraction * hist->total);
+  long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+  {
+    seen += hist->counts[i];
+    if (seen >= rank && seen > 0)
+      return bucketLimit(i) < hist->max_ms ? bucketLimit(i) : hist->max_ms;
+  }
+  return 0;
+}
+
+/**
+ * @brief Format a byte count with a unit
+ * 
+ * @param bytes 
+ * @param buf 
+ * @param size 
+ */
+static void formatBytes(unsigned long long bytes, char *buf, int size)
+{
+  if (bytes < 1024)
+    snprintf(buf, size, "%lluB", bytes);
+  else if (bytes < 1024 * 1024)
+    snprintf(buf, size, "%.1fKB", bytes / 1024.0);
+  else if (bytes < 1024ULL * 1024 * 1024)
+    snprintf(buf, size, "%.1fMB", bytes / (1024.0 * 1024));
+  else
+    snprintf(buf, size, "%.1fGB", bytes / (1024.0 * 1024 * 1024));
+}
+
+/**
+ * @brief Count a command starting on a node
+ * 
+ * @param node 
+ */
+void statsNodeStart(int node)
+{
+  if (node <= 0 || node > MAX_CLIENTS_ALLOWED)
+    return;
+  pthread_mutex_lock(&stats_lock);
+  nodes[node].in_flight++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * @brief Count a command of a node as done
+ * 
+ * @param node 
+ * @param latency_ms from sending the request to receiving the status
+ * @param sent bytes sent to the node
+ * @param received bytes received from the node
+ * @param outcome STATS_OK, STATS_FAILED, STATS_TIMEOUT or STATS_ERROR
+ */
+void statsNodeDone(int node, long long latency_ms, size_t sent, size_t received, int outcome)
+{
+  if (node <= 0 || node > MAX_CLIENTS_ALLOWED)
+    return;
+  pthread_mutex_lock(&stats_lock);
+  struct node_stats *stats = &nodes[node];
+  stats->in_flight--;
+  stats->commands++;
+  stats->bytes_sent += sent;
+  stats->bytes_received += received;
+  if (outcome == STATS_FAILED)
+    stats->failed++;
+  else if (outcome == STATS_TIMEOUT)
+    stats->timeouts++;
+  else if (outcome == STATS_ERROR)
+    stats->errors++;
+  if (outcome != STATS_ERROR)
+    addLatency(&stats->latency, latency_ms);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * @brief Count a failed attempt to contact a node
+ * 
+ * @param node 
+ */
+void statsConnectionError(int node)
+{
+  if (node <= 0 || node > MAX_CLIENTS_ALLOWED)
+    return;
+  pthread_mutex_lock(&stats_lock);
+  nodes[node].errors++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * @brief Count a command pipe run by a session, in the counters of the
+ * session and of the server
+ * 
+ * @param session 
+ * @param latency_ms 
+ * @param sent bytes sent to nodes
+ * @param received bytes received from nodes
+ * @param failed 
+ */
+void statsCommandDone(struct session_stats *session, long long latency_ms, size_t sent, size_t received, bool failed)
+{
+  pthread_mutex_lock(&stats_lock);
+  struct session_stats *all[2] = {session, &server_totals};
+  for (int i = 0; i < 2; i++)
+  {
+    if (all[i] == NULL)
+      continue;
+    all[i]->commands++;
+    all[i]->failed += failed;
+    all[i]->bytes_sent += sent;
+    all[i]->bytes_received += received;
+    addLatency(&all[i]->latency, latency_ms);
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * @brief Append a line with the counters of a session
+ * 
+ * @param name 
+ * @param stats 
+ * @param out 
+ */
+static void reportSession(char *name, struct session_stats *stats, struct buffer *out)
+{
+  char line[256], sent[16], received[16];
+  formatBytes(stats->bytes_sent, sent, sizeof(sent));
+  formatBytes(stats->bytes_received, received, sizeof(received));
+  snprintf(line, sizeof(line), "%-7s cmds=%ld failed=%ld p50=%lldms p90=%lldms p99=%lldms max=%lldms sent=%s recv=%s\n", name,
+           stats->commands, stats->failed, percentile(&stats->latency, 0.5), percentile(&stats->latency, 0.9),
+           percentile(&stats->latency, 0.99), stats->latency.max_ms, sent, received);
+  bufferAppend(out, line, strlen(line));
+}
+
+/**
+ * @brief Append a report of the counters of every node that ran commands,
+ * of the session (if given) and of the whole server to out
+ * 
+ * @param session 
+ * @param out 
+ */
+void statsReport(struct session_stats *session, struct buffer *out)
+{
+  char line[256], sent[16], received[16];
+  pthread_mutex_lock(&stats_lock);
+  for (int i = 1; i <= MAX_CLIENTS_ALLOWED; i++)
+  {
+    struct node_stats *stats = &nodes[i];
+    if (stats->commands == 0 && stats->errors == 0 && stats->in_flight == 0)
+      continue;
+    formatBytes(stats->bytes_sent, sent, sizeof(sent));
+    formatBytes(stats->bytes_received, received, sizeof(received));
+    snprintf(line, sizeof(line), "n%-6d cmds=%ld inflight=%ld failed=%ld timeouts=%ld errors=%ld p50=%lldms p90=%lldms p99=%lldms sent=%s recv=%s\n",
+             i, stats->commands, stats->in_flight, stats->failed, stats->timeouts, stats->errors, percentile(&stats->latency, 0.5),
+             percentile(&stats->latency, 0.9), percentile(&stats->latency, 0.99), sent, received);
+    bufferAppend(out, line, strlen(line));
+  }
+  if (session != NULL)
+    reportSession("session", session, out);
+  reportSession("total", &server_totals, out);
+  pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "utils.h"
+
+// latencies are counted in buckets of about 25% width: one per millisecond
+// below 4ms, then 4 per power of two up to about 9 hours
+#define LATENCY_BUCKETS 96
+
+// how the command of a node ended
+#define STATS_OK 0
+#define STATS_FAILED 1  // non zero exit status or output on stderr
+#define STATS_TIMEOUT 2 // timed out or cancelled
+#define STATS_ERROR 3   // the node could not be reached or the stream broke
+
+struct latency_histogram
+{
+  long counts[LATENCY_BUCKETS];
+  long total;
+  long long sum_ms;
+  long long max_ms;
+};
+
+struct node_stats
+{
+  long commands;
+  long failed;
+  long timeouts;
+  long errors;
+  long in_flight;
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+  struct latency_histogram latency;
+};
+
+// command pipes run by a session (or by the whole server)
+struct session_stats
+{
+  long commands;
+  long failed;
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+  struct latency_histogram latency;
+};
+
+void statsNodeStart(int node);
+
+void statsNodeDone(int node, long long latency_ms, size_t sent, size_t received, int outcome);
+
+void statsConnectionError(int node);
+
+void statsCommandDone(struct session_stats *session, long long latency_ms, size_t sent, size_t received, bool failed);
+
+void statsReport(struct session_stats *session, struct buffer *out);
+
+#endif
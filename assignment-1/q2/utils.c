@@ -50,10 +50,59 @@ int serverSetup(int port)
   assert(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) != -1, "setsockopt error", sfd, -1);
   assert(bind(sfd, (struct sockaddr *)&saddr, sizeof(saddr)) != -1, "server bind error", sfd, -1);
   assert(listen(sfd, TCP_BACKLOG) != -1, "server listen error", sfd, -1);
+  fcntl(sfd, F_SETFD, FD_CLOEXEC);
 
   return sfd;
 }
 
+/**
+ * @brief Setup a Unix socket server at the given path, replacing whatever
+ * a previous run left there
+ * 
+ * @param path 
+ * @return int socket fd
+ */
+int unixServerSetup(char *path)
+{
+  struct sockaddr_un saddr;
+  int sfd;
+  memset(&saddr, 0, sizeof(saddr));
+  saddr.sun_family = AF_UNIX;
+  assert(strlen(path) < sizeof(saddr.sun_path), "unix socket path too long", -1, -1);
+  strcpy(saddr.sun_path, path);
+
+  unlink(path);
+  assert((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "unix socket setup error", -1, -1);
+  assert(bind(sfd, (struct sockaddr *)&saddr, sizeof(saddr)) != -1, "unix socket bind error", sfd, -1);
+  assert(listen(sfd, TCP_BACKLOG) != -1, "unix socket listen error", sfd, -1);
+  fcntl(sfd, F_SETFD, FD_CLOEXEC);
+
+  return sfd;
+}
+
+/**
+ * @brief Setup a UDP socket on given port to receive heartbeats of nodes
+ * 
+ * @param port 
+ * @return int 
+ */
+int heartbeatSetup(int port)
+{
+  struct sockaddr_in saddr;
+  int ufd;
+  memset(&saddr, 0, sizeof(saddr));
+
+  saddr.sin_port = htons(port);
+  saddr.sin_family = AF_INET;
+  saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  assert((ufd = socket(PF_INET, SOCK_DGRAM, 0)) != -1, "heartbeat socket setup error", -1, -1);
+  assert(bind(ufd, (struct sockaddr *)&saddr, sizeof(saddr)) != -1, "heartbeat socket bind error", ufd, -1);
+  fcntl(ufd, F_SETFD, FD_CLOEXEC);
+
+  return ufd;
+}
+
 /**
  * @brief Parse the config file having (n1 IP) lines
  * 
@@ -125,6 +174,8 @@ void resetCommandPipe(struct command_pipe *cmd_pipe)
   {
     struct command *temp = head->next;
     cmd_pipe->count -= 1;
+    if (head->cmd_owned)
+      free(head->cmd);
     free(head);
     head = temp;
   }
@@ -152,10 +203,81 @@ void insertCommandInPipe(struct command_pipe *cmd_pipe, struct command *cmd)
   cmd_pipe->count += 1;
 }
 
+/**
+ * @brief Check if the first len characters of tok (ignoring leading spaces)
+ * are a machine alias, ie. nany or nleast
+ * 
+ * @param tok 
+ * @param len 
+ * @return true 
+ * @return false 
+ */
+static bool isMachineAlias(char *tok, int len)
+{
+  while (len > 0 && *tok == ' ')
+  {
+    tok++;
+    len--;
+  }
+  return (len == 4 && strncmp(tok, "nany", 4) == 0) || (len == 6 && strncmp(tok, "nleast", 6) == 0);
+}
+
+/**
+ * @brief Check if the first len characters of tok (ignoring leading spaces)
+ * name all machines, ie. start with n* (which a deadline or a partition
+ * mode can follow)
+ * 
+ * @param tok 
+ * @param len 
+ * @return true 
+ * @return false 
+ */
+static bool isAllMachines(char *tok, int len)
+{
+  while (len > 0 && *tok == ' ')
+  {
+    tok++;
+    len--;
+  }
+  return len >= 2 && tok[0] == 'n' && tok[1] == '*';
+}
+
+/**
+ * @brief Parse the partition mode of a n* command: split or hash, followed
+ * by +sort to merge the sorted outputs
+ * 
+ * @param mode 
+ * @param cmd 
+ * @return int 0 on success, -1 if the mode is invalid
+ */
+static int parsePartition(char *mode, struct command *cmd)
+{
+  char *plus = strchr(mode, '+');
+  if (plus != NULL)
+  {
+    if (strcmp(plus, "+sort") != 0)
+      return -1;
+    *plus = '\0';
+    cmd->sort_merge = true;
+  }
+  if (strcmp(mode, "split") == 0)
+    cmd->partition = PARTITION_SPLIT;
+  else if (strcmp(mode, "hash") == 0)
+    cmd->partition = PARTITION_HASH;
+  else
+    return -1;
+  return 0;
+}
+
 /**
  * @brief Create the command pipe from command input
  * If no machine is specified in a command (eg: ls), then machine_name = -1
  * If it is a broadcast (eg: n*.ls), then machine_name = 0
+ * If it should run on the least loaded machine (eg: nany.ls), then machine_name = MACHINE_ANY
+ * A deadline can follow the machine name (eg: n2[5s].ls, n*[500ms].ls)
+ * The input of a n* command can be partitioned instead of broadcast by
+ * adding /split or /hash right after n*, and +sort after that to merge the
+ * sorted outputs of the nodes
  * 
  * @param cmd_input 
  * @param cmd_pipe 
@@ -171,9 +293,9 @@ void createCommandPipe(char *cmd_input, struct command_pipe *cmd_pipe)
     {
       int dot_idx = (int)(dot - tok);
 
-      if (dot_idx > 0 && (isdigit(tok[dot_idx - 1]) || tok[dot_idx - 1] == '*') && dot_idx >= 2)
+      if (dot_idx > 0 && (isdigit(tok[dot_idx - 1]) || tok[dot_idx - 1] == '*' || tok[dot_idx - 1] == ']' || isMachineAlias(tok, dot_idx) || isAllMachines(tok, dot_idx)) && dot_idx >= 2)
       { // just some assumptions to make dot thing more robust
-        char *machine_name = (char *)calloc(10, sizeof(char));
+        char *machine_name = (char *)calloc(dot_idx + 1, sizeof(char));
         int i;
         for (i = 0; i < dot_idx; i++)
         {
@@ -185,6 +307,33 @@ void createCommandPipe(char *cmd_input, struct command_pipe *cmd_pipe)
         while (*machine_name == ' ')
           machine_name++;
 
+        char *bracket = strchr(machine_name, '[');
+        char *bracket_end = bracket ? strchr(bracket, ']') : NULL;
+        if (bracket_end != NULL)
+        {
+          *bracket_end = '\0';
+          cmd->timeout_ms = parseDuration(bracket + 1);
+          if (cmd->timeout_ms == -1)
+          {
+            printf("Invalid timeout [%s] in %s, running without one\n", bracket + 1, machine_name);
+            cmd->timeout_ms = 0;
+          }
+          memmove(bracket, bracket_end + 1, strlen(bracket_end + 1) + 1);
+        }
+
+        char *slash = strchr(machine_name, '/');
+        if (slash != NULL)
+        {
+          *slash = '\0';
+          if (strcmp(machine_name, "n*") != 0 || parsePartition(slash + 1, cmd) == -1)
+          {
+            printf("Invalid partition /%s for %s, use n*/split, n*/hash, n*/split+sort or n*/hash+sort\n", slash + 1, machine_name);
+            cmd->partition = PARTITION_NONE;
+            cmd->sort_merge = false;
+          }
+        }
+        i = strlen(machine_name);
+
         if (*machine_name != 'n')
         {
           printf("Machine name %s does not begin with 'n'\n", machine_name);
@@ -201,6 +350,10 @@ void createCommandPipe(char *cmd_input, struct command_pipe *cmd_pipe)
         {
           machine = 0; // broadcast
         }
+        else if (strcmp(machine_name, "nany") == 0 || strcmp(machine_name, "nleast") == 0)
+        {
+          machine = MACHINE_ANY; // least loaded machine
+        }
         else
         {
           machine = atoi(machine_name + 1);
@@ -245,6 +398,8 @@ void printCommand(struct command *cmd)
     printf("Command: %s, Machine: local", cmd->cmd);
   else if (cmd->machine == 0)
     printf("Command: %s, Machine: n*", cmd->cmd);
+  else if (cmd->machine == MACHINE_ANY)
+    printf("Command: %s, Machine: nany", cmd->cmd);
   else
     printf("Command: %s, Machine: invalid", cmd->cmd);
   printf("\n=== End Command ===\n");
@@ -267,6 +422,218 @@ void printCommandPipe(struct command_pipe *cmd_pipe)
   }
 }
 
+/**
+ * @brief Check if the command is a change dir command. It changes the
+ * directory of the clustershell_client itself, so it must run on its own.
+ * 
+ * @param cmd 
+ * @return true 
+ * @return false 
+ */
+bool isChangeDir(char *cmd)
+{
+  while (*cmd == ' ')
+    cmd++;
+  return cmd[0] == 'c' && cmd[1] == 'd' && (cmd[2] == ' ' || cmd[2] == '\0');
+}
+
+/**
+ * @brief Planning pass over the command pipe, run before executing it.
+ * Local commands are bound to local_machine, and consecutive commands on
+ * the same machine are merged into one command that is piped by the
+ * machine's own shell (n2.ls | n2.grep a | n2.wc runs as "ls | grep a | wc"
+ * on n2), which saves a hop and a copy of the intermediate output for each
+ * merged command. Broadcasts are never merged since the output of every
+ * node is gathered before the next command runs, and neither are commands
+ * with different deadlines.
+ * 
+ * @param cmd_pipe 
+ * @param local_machine machine number (n<local_machine>) local commands run on
+ */
+void planCommandPipe(struct command_pipe *cmd_pipe, int local_machine)
+{
+  struct command *curr = cmd_pipe->head;
+  while (curr)
+  {
+    if (curr->machine == -1)
+      curr->machine = local_machine;
+    curr = curr->next;
+  }
+
+  curr = cmd_pipe->head;
+  while (curr && curr->next)
+  {
+    struct command *next = curr->next;
+    if (curr->machine <= 0 || curr->machine != next->machine || curr->timeout_ms != next->timeout_ms || isChangeDir(curr->cmd) || isChangeDir(next->cmd))
+    {
+      curr = next;
+      continue;
+    }
+
+    int len = strlen(curr->cmd) + strlen(next->cmd) + 4;
+    char *merged = (char *)calloc(len, sizeof(char));
+    assert(merged != NULL, "calloc error while merging commands", -1, -1);
+    sprintf(merged, "%s | %s", curr->cmd, next->cmd);
+
+    if (curr->cmd_owned)
+      free(curr->cmd);
+    if (next->cmd_owned)
+      free(next->cmd);
+    curr->cmd = merged;
+    curr->cmd_owned = true;
+    curr->next = next->next;
+    if (cmd_pipe->tail == next)
+      cmd_pipe->tail = curr;
+    cmd_pipe->count -= 1;
+    free(next);
+  }
+}
+
+/**
+ * @brief Write a one line description of the command pipe (the plan) to buf
+ * 
+ * @param cmd_pipe 
+ * @param buf 
+ * @param size 
+ * @return int number of characters written
+ */
+int formatCommandPipe(struct command_pipe *cmd_pipe, char *buf, int size)
+{
+  int offset = 0;
+  buf[0] = '\0';
+  for (struct command *curr = cmd_pipe->head; curr && offset < size; curr = curr->next)
+  {
+    char *cmd = curr->cmd;
+    char deadline[48] = "";
+    while (*cmd == ' ')
+      cmd++;
+    if (curr->partition != PARTITION_NONE)
+      snprintf(deadline, sizeof(deadline), "/%s%s", curr->partition == PARTITION_SPLIT ? "split" : "hash", curr->sort_merge ? "+sort" : "");
+    if (curr->timeout_ms > 0)
+      snprintf(deadline + strlen(deadline), sizeof(deadline) - strlen(deadline), " %dms", curr->timeout_ms);
+    if (curr->machine > 0)
+      offset += snprintf(buf + offset, size - offset, "%s[n%d%s] %s", offset ? " -> " : "", curr->machine, deadline, cmd);
+    else if (curr->machine == 0)
+      offset += snprintf(buf + offset, size - offset, "%s[n*%s] %s", offset ? " -> " : "", deadline, cmd);
+    else if (curr->machine == MACHINE_ANY)
+      offset += snprintf(buf + offset, size - offset, "%s[nany%s] %s", offset ? " -> " : "", deadline, cmd);
+    else
+      offset += snprintf(buf + offset, size - offset, "%s[local%s] %s", offset ? " -> " : "", deadline, cmd);
+  }
+  return offset < size ? offset : size - 1;
+}
+
+/**
+ * @brief Share the lines of the input between count parts. In split mode
+ * the input is cut into count runs of lines of about the same size, so
+ * appending the parts in order gives back the input. In hash mode every
+ * line goes to the part picked by its hash, so equal lines end up in the
+ * same part. The input is read part after part, and a last line without
+ * a newline (in any part) gets one.
+ * 
+ * @param input 
+ * @param mode PARTITION_SPLIT or PARTITION_HASH
+ * @param parts count buffers, initialised here
+ * @param count 
+ */
+void partitionLines(struct buffer_list *input, int mode, struct buffer *parts, int count)
+{
+  for (int i = 0; i < count; i++)
+    bufferInit(&parts[i]);
+  if (count == 0 || input->len == 0)
+    return;
+
+  int part = 0;
+  size_t assigned = 0; // bytes of input handed out so far
+  for (int i = 0; i < input->count; i++)
+  {
+    struct buffer *data = &input->parts[i].data;
+    size_t off = 0;
+    while (off < data->len)
+    {
+      char *line = data->data + off;
+      char *nl = memchr(line, '\n', data->len - off);
+      size_t len = nl ? (size_t)(nl - line) + 1 : data->len - off;
+
+      if (mode == PARTITION_HASH)
+      {
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (size_t j = 0; j < len && line[j] != '\n'; j++)
+          hash = (hash ^ (unsigned char)line[j]) * 16777619u;
+        part = hash % count;
+      }
+      else
+      {
+        // move on to the next part once this one has its share
+        while (part < count - 1 && assigned >= input->len * (part + 1) / count)
+          part++;
+      }
+      assigned += len;
+
+      bufferAppend(&parts[part], line, len);
+      if (nl == NULL)
+        bufferAppend(&parts[part], "\n", 1);
+      off += len;
+    }
+  }
+}
+
+/**
+ * @brief Compare the lines at the start of a and b
+ * 
+ * @param a 
+ * @param a_len bytes left in a
+ * @param b 
+ * @param b_len bytes left in b
+ * @return int as strcmp
+ */
+static int compareLines(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  for (size_t i = 0;; i++)
+  {
+    int ca = i < a_len && a[i] != '\n' ? (unsigned char)a[i] : -1;
+    int cb = i < b_len && b[i] != '\n' ? (unsigned char)b[i] : -1;
+    if (ca != cb || ca == -1)
+      return ca - cb;
+  }
+}
+
+/**
+ * @brief Merge inputs made of sorted lines into merged, which ends up
+ * sorted as well (by byte values, like sort with LC_ALL=C)
+ * 
+ * @param inputs 
+ * @param count 
+ * @param merged 
+ */
+void mergeSortedLines(struct buffer *inputs, int count, struct buffer *merged)
+{
+  size_t offs[count];
+  memset(offs, 0, sizeof(offs));
+  for (;;)
+  {
+    int min = -1;
+    for (int i = 0; i < count; i++)
+    {
+      if (offs[i] >= inputs[i].len)
+        continue;
+      if (min == -1 || compareLines(inputs[i].data + offs[i], inputs[i].len - offs[i], inputs[min].data + offs[min], inputs[min].len - offs[min]) < 0)
+        min = i;
+    }
+    if (min == -1)
+      break;
+
+    char *line = inputs[min].data + offs[min];
+    size_t left = inputs[min].len - offs[min];
+    char *nl = memchr(line, '\n', left);
+    size_t len = nl ? (size_t)(nl - line) + 1 : left;
+    bufferAppend(merged, line, len);
+    if (nl == NULL)
+      bufferAppend(merged, "\n", 1);
+    offs[min] += len;
+  }
+}
+
 /**
  * @brief Setup TCP connection to a server at given address and port
  * 
@@ -297,4 +664,1084 @@ int clientSetup(char *addr, int port, int arg_fd)
   }
 
   return sfd;
-}
\ No newline at end of file
+}
+/**
+ * @brief Setup TCP connection to a server at given address and port, or
+ * a Unix socket connection if the address is a path (starts with /).
+ * Unlike clientSetup, a failure is returned to the caller instead of
+ * terminating the process.
+ * 
+ * @param addr 
+ * @param port 
+ * @return int socket fd, or -1 on failure
+ */
+int clientConnect(char *addr, int port)
+{
+  struct sockaddr_storage saddr;
+  socklen_t slen;
+  int sfd;
+  memset(&saddr, 0, sizeof(saddr));
+
+  if (addr[0] == '/')
+  {
+    struct sockaddr_un *uaddr = (struct sockaddr_un *)&saddr;
+    uaddr->sun_family = AF_UNIX;
+    strncpy(uaddr->sun_path, addr, sizeof(uaddr->sun_path) - 1);
+    slen = sizeof(struct sockaddr_un);
+  }
+  else
+  {
+    struct sockaddr_in *iaddr = (struct sockaddr_in *)&saddr;
+    iaddr->sin_port = htons(port);
+    iaddr->sin_family = AF_INET;
+    iaddr->sin_addr.s_addr = inet_addr(addr);
+    slen = sizeof(struct sockaddr_in);
+  }
+
+  if ((sfd = socket(saddr.ss_family, SOCK_STREAM, 0)) == -1)
+  {
+    printf("Socket creation error while connecting to IP: %s, Port: %d.\n", addr, port);
+    return -1;
+  }
+  if (connect(sfd, (struct sockaddr *)&saddr, slen) == -1)
+  {
+    printf("Could not connect to IP: %s, Port: %d.\n", addr, port);
+    close(sfd);
+    return -1;
+  }
+  fcntl(sfd, F_SETFD, FD_CLOEXEC);
+
+  return sfd;
+}
+
+/**
+ * @brief Init an empty buffer
+ * 
+ * @param buf 
+ */
+void bufferInit(struct buffer *buf)
+{
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+/**
+ * @brief Append bytes to the buffer, growing it if required. The data is
+ * always kept null terminated so that it can be printed directly.
+ * 
+ * @param buf 
+ * @param data 
+ * @param len 
+ */
+void bufferAppend(struct buffer *buf, const char *data, size_t len)
+{
+  if (buf->len + len + 1 > buf->cap)
+  {
+    size_t cap = buf->cap == 0 ? MAX_OUTPUT_SIZE : buf->cap;
+    while (buf->len + len + 1 > cap)
+      cap *= 2;
+    buf->data = (char *)realloc(buf->data, cap);
+    assert(buf->data != NULL, "realloc error while growing buffer", -1, -1);
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+/**
+ * @brief Free up memory held by the buffer
+ * 
+ * @param buf 
+ */
+void bufferFree(struct buffer *buf)
+{
+  free(buf->data);
+  bufferInit(buf);
+}
+
+/**
+ * @brief Write the whole data to fd, retrying on short writes
+ * 
+ * @param fd 
+ * @param data 
+ * @param len 
+ * @return int 0 on success, -1 on error
+ */
+int writeAll(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, data, len);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Init an empty buffer list
+ * 
+ * @param list 
+ */
+void bufferListInit(struct buffer_list *list)
+{
+  list->parts = NULL;
+  list->count = 0;
+  list->cap = 0;
+  list->len = 0;
+}
+
+/**
+ * @brief Add the data of buf to the list as a part of its own, without
+ * copying it. The list takes over the memory of buf, which is left empty.
+ * 
+ * @param list 
+ * @param node node the data came from, 0 if none
+ * @param buf 
+ */
+void bufferListAdd(struct buffer_list *list, int node, struct buffer *buf)
+{
+  if (list->count == list->cap)
+  {
+    list->cap = list->cap ? 2 * list->cap : 8;
+    list->parts = (struct buffer_part *)realloc(list->parts, list->cap * sizeof(struct buffer_part));
+    assert(list->parts != NULL, "realloc error while growing buffer list", -1, -1);
+  }
+  list->parts[list->count].node = node;
+  list->parts[list->count].data = *buf;
+  list->count++;
+  list->len += buf->len;
+  bufferInit(buf);
+}
+
+/**
+ * @brief Add a copy of the data to the list as a part of its own
+ * 
+ * @param list 
+ * @param node node the data came from, 0 if none
+ * @param data 
+ * @param len 
+ */
+void bufferListAppend(struct buffer_list *list, int node, const char *data, size_t len)
+{
+  struct buffer buf;
+  bufferInit(&buf);
+  bufferAppend(&buf, data, len);
+  bufferListAdd(list, node, &buf);
+}
+
+/**
+ * @brief Free up memory held by the list and its parts
+ * 
+ * @param list 
+ */
+void bufferListFree(struct buffer_list *list)
+{
+  for (int i = 0; i < list->count; i++)
+    bufferFree(&list->parts[i].data);
+  free(list->parts);
+  bufferListInit(list);
+}
+
+/**
+ * @brief Write all parts of the list to fd in order with writev, up to
+ * IOV_MAX parts per call, retrying on short writes
+ * 
+ * @param fd 
+ * @param list 
+ * @return int 0 on success, -1 on error
+ */
+int writeBufferList(int fd, struct buffer_list *list)
+{
+  struct iovec iov[IOV_MAX];
+  int part = 0;
+  size_t off = 0; // bytes of parts[part] already written
+  for (;;)
+  {
+    int n = 0;
+    for (int i = part; i < list->count && n < IOV_MAX; i++)
+    {
+      struct buffer *data = &list->parts[i].data;
+      size_t skip = i == part ? off : 0;
+      if (data->len == skip)
+        continue;
+      iov[n].iov_base = data->data + skip;
+      iov[n].iov_len = data->len - skip;
+      n++;
+    }
+    if (n == 0)
+      return 0;
+
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (written > 0)
+    {
+      size_t left = list->parts[part].data.len - off;
+      if ((size_t)written < left)
+      {
+        off += written;
+        break;
+      }
+      written -= left;
+      part++;
+      off = 0;
+    }
+  }
+}
+
+/**
+ * @brief Send a stage request header. hops[0] is the stage the receiver
+ * runs, the rest are the stages after it. The header has the form
+ *   EXEC <cmd>
+ *   NODE <node>
+ *   TIMEOUT <ms>                      (only if the stage has a deadline)
+ *   ZIP 1                             (if frames may be compressed)
+ *   NEXT <node> <ip> <port> <ms> <cmd> (once per later stage, 0 ms for none)
+ *   FANOUT <k>                        (only for a relayed broadcast)
+ *   RELAY <node> <ip> <port>          (once per node of the relay subtree)
+ *   <empty line>
+ * and is followed by the input frames of the command.
+ * 
+ * @param fd 
+ * @param hops 
+ * @param hop_count 
+ * @param relays nodes the receiver relays the command to, or NULL
+ * @param relay_count 
+ * @param fanout number of nodes the receiver contacts directly
+ * @param zip frames may be compressed both ways
+ * @return int 0 on success, -1 on error
+ */
+int writeRequestHeader(int fd, struct hop *hops, int hop_count, struct hop *relays, int relay_count, int fanout, bool zip)
+{
+  struct buffer hdr;
+  char line[MAX_COMMAND_SIZE + 64];
+  bufferInit(&hdr);
+
+  snprintf(line, sizeof(line), "EXEC %s\nNODE %d\n", hops[0].cmd, hops[0].node);
+  bufferAppend(&hdr, line, strlen(line));
+  if (hops[0].timeout_ms > 0)
+  {
+    snprintf(line, sizeof(line), "TIMEOUT %d\n", hops[0].timeout_ms);
+    bufferAppend(&hdr, line, strlen(line));
+  }
+  if (zip)
+    bufferAppend(&hdr, "ZIP 1\n", 6);
+  // a node reaches the next one over its Unix socket when both are
+  // co-located with the server
+  for (int i = 1; i < hop_count; i++)
+  {
+    char *addr = hops[i].path && hops[i - 1].path ? hops[i].path : hops[i].ip;
+    snprintf(line, sizeof(line), "NEXT %d %s %d %d %s\n", hops[i].node, addr, hops[i].port, hops[i].timeout_ms, hops[i].cmd);
+    bufferAppend(&hdr, line, strlen(line));
+  }
+  if (relay_count > 0)
+  {
+    snprintf(line, sizeof(line), "FANOUT %d\n", fanout);
+    bufferAppend(&hdr, line, strlen(line));
+  }
+  // any node of a relay group may relay to any other, so Unix sockets are
+  // only used if the whole group is co-located with the server
+  bool local = hops[0].path != NULL;
+  for (int i = 0; i < relay_count; i++)
+    local = local && relays[i].path != NULL;
+  for (int i = 0; i < relay_count; i++)
+  {
+    snprintf(line, sizeof(line), "RELAY %d %s %d\n", relays[i].node, local ? relays[i].path : relays[i].ip, relays[i].port);
+    bufferAppend(&hdr, line, strlen(line));
+  }
+  bufferAppend(&hdr, "\n", 1);
+
+  int status = hdr.len > MAX_HEADER_SIZE ? -1 : writeAll(fd, hdr.data, hdr.len);
+  bufferFree(&hdr);
+  return status;
+}
+
+/**
+ * @brief Read what has arrived of a stage request header (see
+ * writeRequestHeader) from a non-blocking fd, and parse it once the blank
+ * line ending it is in. The bytes are peeked first so that none of the
+ * frames that follow the header are consumed. The hops of the request are
+ * the stages after this one.
+ * 
+ * @param fd 
+ * @param req 
+ * @param len bytes of the header read so far, 0 on the first call
+ * @return int 1 once the header is parsed, 0 if more is to come, -1 on a
+ * malformed header or read error
+ */
+int readRequestHeader(int fd, struct stage_request *req, int *len)
+{
+  char *header = req->header;
+  for (;;)
+  {
+    if (*len == MAX_HEADER_SIZE)
+      return -1;
+    int n = recv(fd, header + *len, MAX_HEADER_SIZE - *len, MSG_PEEK | MSG_DONTWAIT);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0)
+      return -1;
+
+    int take = n;
+    bool done = false;
+    for (int i = *len; i < *len + n; i++)
+    {
+      if (header[i] == '\n' && (i == 0 || header[i - 1] == '\n'))
+      {
+        take = i + 1 - *len;
+        done = true;
+        break;
+      }
+    }
+    if (read(fd, header + *len, take) != take)
+      return -1;
+    *len += take;
+    if (done)
+      break;
+  }
+  header[*len] = '\0';
+  if (*len == 1)
+    return -1;
+
+  req->cmd = NULL;
+  req->node = 0;
+  req->timeout_ms = 0;
+  req->hop_count = 0;
+  req->relay_count = 0;
+  req->fanout = 0;
+  req->zip = false;
+  char *line = header;
+  char *end;
+  while ((end = strchr(line, '\n')) != NULL && end != line)
+  {
+    *end = '\0';
+    if (strncmp(line, "EXEC ", 5) == 0)
+    {
+      req->cmd = line + 5;
+    }
+    else if (strncmp(line, "NODE ", 5) == 0)
+    {
+      req->node = atoi(line + 5);
+    }
+    else if (strncmp(line, "TIMEOUT ", 8) == 0)
+    {
+      req->timeout_ms = atoi(line + 8);
+    }
+    else if (strncmp(line, "NEXT ", 5) == 0)
+    {
+      if (req->hop_count == MAX_HOPS)
+        return -1;
+      struct hop *hop = &req->hops[req->hop_count];
+      char *node = strtok(line + 5, " ");
+      hop->ip = strtok(NULL, " ");
+      char *port = strtok(NULL, " ");
+      char *timeout = strtok(NULL, " ");
+      hop->cmd = strtok(NULL, "");
+      if (node == NULL || hop->ip == NULL || port == NULL || timeout == NULL || hop->cmd == NULL)
+        return -1;
+      hop->node = atoi(node);
+      hop->port = atoi(port);
+      hop->timeout_ms = atoi(timeout);
+      hop->path = NULL;
+      req->hop_count++;
+    }
+    else if (strncmp(line, "ZIP ", 4) == 0)
+    {
+      req->zip = atoi(line + 4) == 1;
+    }
+    else if (strncmp(line, "FANOUT ", 7) == 0)
+    {
+      req->fanout = atoi(line + 7);
+    }
+    else if (strncmp(line, "RELAY ", 6) == 0)
+    {
+      if (req->relay_count == MAX_CLIENTS_ALLOWED)
+        return -1;
+      struct hop *relay = &req->relays[req->relay_count];
+      char *node = strtok(line + 6, " ");
+      relay->ip = strtok(NULL, " ");
+      char *port = strtok(NULL, " ");
+      if (node == NULL || relay->ip == NULL || port == NULL)
+        return -1;
+      relay->node = atoi(node);
+      relay->port = atoi(port);
+      relay->timeout_ms = req->timeout_ms;
+      relay->cmd = NULL;
+      relay->path = NULL;
+      req->relay_count++;
+    }
+    line = end + 1;
+  }
+
+  if (req->relay_count > 0 && req->fanout < 1)
+    return -1;
+  return req->cmd == NULL ? -1 : 1;
+}
+
+/**
+ * @brief Run cmd through the shell with its stdin, stdout and stderr
+ * connected to pipes. The write end of stdin is returned in in_fd and the
+ * read ends of stdout and stderr in out_fd and err_fd. The command gets its
+ * own process group so that it can be signalled as a whole.
+ * 
+ * @param cmd 
+ * @param in_fd 
+ * @param out_fd 
+ * @param err_fd 
+ * @return pid_t pid of the shell, or -1 on error
+ */
+pid_t spawnCommand(char *cmd, int *in_fd, int *out_fd, int *err_fd)
+{
+  int fds[3][2];
+  int created = 0;
+  for (; created < 3; created++)
+  {
+    if (pipe(fds[created]) == -1)
+      break;
+  }
+
+  pid_t pid = created == 3 ? fork() : -1;
+  if (pid == -1)
+  {
+    for (int i = 0; i < created; i++)
+    {
+      close(fds[i][0]);
+      close(fds[i][1]);
+    }
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(fds[0][0], STDIN_FILENO);
+    dup2(fds[1][1], STDOUT_FILENO);
+    dup2(fds[2][1], STDERR_FILENO);
+    for (int i = 0; i < 3; i++)
+    {
+      close(fds[i][0]);
+      close(fds[i][1]);
+    }
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+
+  setpgid(pid, pid); // also here, so the group exists before we signal it
+  close(fds[0][0]);
+  close(fds[1][1]);
+  close(fds[2][1]);
+  *in_fd = fds[0][1];
+  *out_fd = fds[1][0];
+  *err_fd = fds[2][0];
+  fcntl(*in_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(*out_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(*err_fd, F_SETFD, FD_CLOEXEC);
+  return pid;
+}
+
+/**
+ * @brief Append the payload to buf as frames of the given type, like
+ * writeFrames does for an fd
+ * 
+ * @param buf 
+ * @param type 
+ * @param node 
+ * @param payload 
+ * @param len 
+ */
+void appendFrames(struct buffer *buf, int type, int node, const char *payload, size_t len)
+{
+  char hdr[FRAME_HEADER_SIZE];
+  do
+  {
+    size_t n = len < MAX_FRAME_PAYLOAD ? len : MAX_FRAME_PAYLOAD;
+    packFrameHeader(hdr, type, node, n);
+    bufferAppend(buf, hdr, FRAME_HEADER_SIZE);
+    bufferAppend(buf, payload, n);
+    payload += n;
+    len -= n;
+  } while (len > 0);
+}
+
+/**
+ * @brief Pack a frame header into FRAME_HEADER_SIZE bytes
+ * 
+ * @param buf 
+ * @param type 
+ * @param node 
+ * @param len 
+ */
+void packFrameHeader(char *buf, int type, int node, int len)
+{
+  uint16_t n = htons((uint16_t)node);
+  uint32_t l = htonl((uint32_t)len);
+  buf[0] = (char)type;
+  buf[1] = 0;
+  memcpy(buf + 2, &n, 2);
+  memcpy(buf + 4, &l, 4);
+}
+
+/**
+ * @brief Unpack a frame header packed by packFrameHeader
+ * 
+ * @param buf 
+ * @param hdr 
+ */
+void unpackFrameHeader(char *buf, struct frame_header *hdr)
+{
+  uint16_t n;
+  uint32_t l;
+  memcpy(&n, buf + 2, 2);
+  memcpy(&l, buf + 4, 4);
+  hdr->type = (unsigned char)buf[0];
+  hdr->flags = (unsigned char)buf[1];
+  hdr->node = ntohs(n);
+  hdr->len = ntohl(l);
+}
+
+/**
+ * @brief Write the payload as frames of the given type, splitting it into
+ * frames of at most MAX_FRAME_PAYLOAD bytes. An empty payload is sent as
+ * one empty frame.
+ * 
+ * @param fd 
+ * @param type 
+ * @param node 
+ * @param payload 
+ * @param len 
+ * @return int 0 on success, -1 on error
+ */
+int writeFrames(int fd, int type, int node, const char *payload, size_t len)
+{
+  char frame[PUMP_CHUNK_SIZE];
+  do
+  {
+    size_t n = len < MAX_FRAME_PAYLOAD ? len : MAX_FRAME_PAYLOAD;
+    packFrameHeader(frame, type, node, n);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, n);
+    if (writeAll(fd, frame, FRAME_HEADER_SIZE + n) == -1)
+      return -1;
+    payload += n;
+    len -= n;
+  } while (len > 0);
+  return 0;
+}
+
+/**
+ * @brief Init a pump copying data from in_fd to out_fd. Either fd can be
+ * -1 and replaced by setting src (read from buffer) or src_list (read
+ * from the parts of a buffer list) or dst (append to buffer). If both out_fd is -1 and dst is NULL, the input is discarded.
+ * Set mode and the frame fields afterwards to encode or decode frames.
+ * 
+ * @param p 
+ * @param in_fd 
+ * @param out_fd 
+ * @param on_eof PUMP_KEEP, PUMP_CLOSE or PUMP_SHUTDOWN
+ */
+void initPump(struct pump *p, int in_fd, int out_fd, int on_eof)
+{
+  memset(p, 0, sizeof(struct pump));
+  p->in_fd = in_fd;
+  p->out_fd = out_fd;
+  p->on_eof = on_eof;
+}
+
+/**
+ * @brief Finish a pump whose input is exhausted
+ * 
+ * @param p 
+ */
+static void finishPump(struct pump *p)
+{
+  if (p->out_fd >= 0)
+  {
+    if (p->on_eof == PUMP_CLOSE)
+      close(p->out_fd);
+    else if (p->on_eof == PUMP_SHUTDOWN)
+      shutdown(p->out_fd, SHUT_WR);
+  }
+  p->done = true;
+}
+
+/**
+ * @brief Expand a complete compressed FRAME_DATA frame of a decoding pump.
+ * Its payload goes to the output chunk (which has room for it), or to
+ * on_frame when demuxing. A frame that does not expand is dropped and
+ * counts as a read failure.
+ * 
+ * @param p 
+ */
+static void expandFrame(struct pump *p)
+{
+  char plain[MAX_FRAME_PAYLOAD];
+  char *dst = p->demux ? plain : p->chunk + p->len;
+  int len = p->hdr.len <= MAX_FRAME_PAYLOAD ? lzDecompress(p->frame, p->frame_len, dst, MAX_FRAME_PAYLOAD) : -1;
+  if (len == -1)
+  {
+    p->read_failed = true;
+    return;
+  }
+  if (!p->demux)
+  {
+    p->len += len;
+    return;
+  }
+  struct frame_header hdr = p->hdr;
+  hdr.flags &= ~FRAME_COMPRESSED;
+  hdr.len = len;
+  if (p->on_frame)
+    p->on_frame(&hdr, plain, p->frame_arg);
+}
+
+/**
+ * @brief Decode buffered raw input of a decoding pump. Payload of data
+ * frames is moved to the output chunk as long as it has space, other
+ * frames (and data frames too when demuxing) are handed to on_frame once
+ * complete.
+ * 
+ * @param p 
+ */
+static void decodePump(struct pump *p)
+{
+  if (p->len == 0)
+    p->off = 0;
+  while (p->raw_off < p->raw_len && p->len < PUMP_CHUNK_SIZE && !p->end_seen)
+  {
+    bool compressed = p->hdr_len == FRAME_HEADER_SIZE && p->hdr.type == FRAME_DATA && (p->hdr.flags & FRAME_COMPRESSED);
+    if (compressed && !p->demux && p->len > PUMP_CHUNK_SIZE - MAX_FRAME_PAYLOAD)
+      break; // no room for the frame once expanded, flush the output first
+
+    if (p->hdr_len < FRAME_HEADER_SIZE)
+    {
+      p->hdr_bytes[p->hdr_len++] = p->raw[p->raw_off++];
+      if (p->hdr_len < FRAME_HEADER_SIZE)
+        continue;
+      unpackFrameHeader(p->hdr_bytes, &p->hdr);
+      p->payload_left = p->hdr.len;
+      p->frame_len = 0;
+    }
+    else
+    {
+      size_t n = p->raw_len - p->raw_off;
+      if (n > p->payload_left)
+        n = p->payload_left;
+      if (p->hdr.type == FRAME_DATA && !p->demux && !compressed)
+      {
+        if (n > PUMP_CHUNK_SIZE - p->len)
+          n = PUMP_CHUNK_SIZE - p->len;
+        memcpy(p->chunk + p->len, p->raw + p->raw_off, n);
+        p->len += n;
+      }
+      else
+      {
+        size_t keep = MAX_FRAME_PAYLOAD - p->frame_len;
+        memcpy(p->frame + p->frame_len, p->raw + p->raw_off, n < keep ? n : keep);
+        p->frame_len += n < keep ? n : keep;
+      }
+      p->raw_off += n;
+      p->payload_left -= n;
+    }
+
+    if (p->hdr_len == FRAME_HEADER_SIZE && p->payload_left == 0)
+    { // frame complete
+      if (p->hdr.type == FRAME_END)
+        p->end_seen = true;
+      else if (compressed)
+        expandFrame(p);
+      else if ((p->hdr.type != FRAME_DATA || p->demux) && p->on_frame)
+        p->on_frame(&p->hdr, p->frame, p->frame_arg);
+      p->hdr_len = 0;
+    }
+  }
+}
+
+/**
+ * @brief Compress the payload of the FRAME_DATA frame in the chunk of an
+ * encoding pump, if that makes it smaller
+ * 
+ * @param p 
+ * @param len payload length
+ * @return int payload length once compressed, -1 if left as it is
+ */
+static int compressFrame(struct pump *p, int len)
+{
+  char packed[MAX_FRAME_PAYLOAD];
+  char *payload = p->chunk + FRAME_HEADER_SIZE;
+  int packed_len = lzCompress(payload, len, packed, len - 1);
+  if (packed_len == -1)
+    return -1;
+  memcpy(payload, packed, packed_len);
+  packFrameHeader(p->chunk, FRAME_DATA, p->frame_node, packed_len);
+  p->chunk[1] = FRAME_COMPRESSED;
+  return packed_len;
+}
+
+/**
+ * @brief Read the next piece of input of the pump (from in_fd, src or src_list)
+ * into buf. An end of input is flagged in p->eof.
+ * 
+ * @param p 
+ * @param buf 
+ * @param size 
+ * @return ssize_t number of bytes read, -1 if nothing could be read
+ */
+static ssize_t takeInput(struct pump *p, char *buf, size_t size)
+{
+  ssize_t n;
+  if (p->in_fd >= 0)
+  {
+    n = read(p->in_fd, buf, size);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      return -1;
+    if (n == -1)
+      p->read_failed = true;
+  }
+  else
+  {
+    struct buffer *src = p->src;
+    if (p->src_list)
+    { // move on to the next part once this one is read
+      while (p->src_part < p->src_list->count && p->src_off == p->src_list->parts[p->src_part].data.len)
+      {
+        p->src_part++;
+        p->src_off = 0;
+      }
+      src = p->src_part < p->src_list->count ? &p->src_list->parts[p->src_part].data : NULL;
+    }
+    size_t left = src ? src->len - p->src_off : 0;
+    n = left < size ? left : size;
+    if (n > 0)
+      memcpy(buf, src->data + p->src_off, n);
+    p->src_off += n;
+  }
+
+  if (n <= 0)
+  {
+    // a decoded stream that ends without FRAME_END was cut short
+    if (p->mode == PUMP_DECODE && p->end_frame && !p->end_seen)
+      p->read_failed = true;
+    p->eof = true;
+    return -1;
+  }
+  p->bytes += n;
+  return n;
+}
+
+/**
+ * @brief Read input into the pump, converting it as per the pump mode
+ * 
+ * @param p 
+ */
+static void readPump(struct pump *p)
+{
+  ssize_t n;
+  if (p->mode == PUMP_ENCODE)
+  {
+    if ((n = takeInput(p, p->chunk + FRAME_HEADER_SIZE, MAX_FRAME_PAYLOAD)) == -1)
+      return;
+    packFrameHeader(p->chunk, FRAME_DATA, p->frame_node, n);
+    int packed_len = -1;
+    if (p->compress && p->bytes > ZIP_MIN_STREAM && n >= ZIP_MIN_FRAME && (packed_len = compressFrame(p, n)) != -1)
+    {
+      p->bytes -= n - packed_len;
+      n = packed_len;
+    }
+    p->off = 0;
+    p->len = FRAME_HEADER_SIZE + n;
+    p->bytes += FRAME_HEADER_SIZE;
+  }
+  else if (p->mode == PUMP_DECODE)
+  {
+    if ((n = takeInput(p, p->raw, PUMP_CHUNK_SIZE)) == -1)
+      return;
+    p->raw_off = 0;
+    p->raw_len = n;
+    p->off = 0;
+    decodePump(p);
+  }
+  else
+  {
+    if ((n = takeInput(p, p->chunk, PUMP_CHUNK_SIZE)) == -1)
+      return;
+    p->off = 0;
+    p->len = n;
+  }
+}
+
+/**
+ * @brief Make all the progress possible on a pump without touching its
+ * fds: reading from src, writing to dst, decoding and finishing.
+ * 
+ * @param p 
+ * @return true if the pump waits on its input fd (false: output fd or done)
+ */
+static bool servicePump(struct pump *p)
+{
+  for (;;)
+  {
+    if (p->done)
+      return false;
+
+    if (p->len > 0 && (p->out_fd < 0 || p->discard))
+    {
+      if (p->dst && !p->discard && (p->dst_limit == 0 || p->dst->len < p->dst_limit))
+        bufferAppend(p->dst, p->chunk + p->off, p->len);
+      p->len = 0;
+      p->off = 0;
+    }
+    if (p->len > 0)
+      return false;
+
+    if (p->mode == PUMP_DECODE && p->raw_off < p->raw_len && !p->end_seen)
+    {
+      decodePump(p);
+      continue;
+    }
+    if (p->end_seen)
+      p->eof = true;
+
+    if (!p->eof)
+    {
+      if (p->in_fd >= 0)
+        return true;
+      readPump(p);
+      continue;
+    }
+
+    if (p->mode == PUMP_ENCODE && p->end_frame && !p->end_sent)
+    {
+      packFrameHeader(p->chunk, FRAME_END, p->frame_node, 0);
+      p->off = 0;
+      p->len = FRAME_HEADER_SIZE;
+      p->end_sent = true;
+      continue;
+    }
+
+    finishPump(p);
+    // keep an eye on the peer, the stream is over but the run is not
+    p->watching = p->watch_eof && p->end_seen && p->in_fd >= 0;
+    return false;
+  }
+}
+
+/**
+ * @brief Check if a failure of the pump should end runPumps
+ * 
+ * @param p 
+ * @return true 
+ * @return false 
+ */
+static bool pumpAborts(struct pump *p)
+{
+  return ((p->abort_on & PUMP_ABORT_READ) && p->read_failed) || ((p->abort_on & PUMP_ABORT_WRITE) && p->write_failed);
+}
+
+/**
+ * @brief Poll a watching pump: any data after FRAME_END is ignored, the peer
+ * closing the connection counts as a read failure
+ * 
+ * @param p 
+ */
+static void watchPump(struct pump *p)
+{
+  char scratch[64];
+  ssize_t n = read(p->in_fd, scratch, sizeof(scratch));
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0)
+  {
+    p->read_failed = true;
+    p->watching = false;
+  }
+}
+
+/**
+ * @brief Run the pumps concurrently until every one of them has moved all
+ * of its input. All fds are switched to non-blocking mode while pumping
+ * (and restored afterwards) so that a stalled peer never blocks the other
+ * directions, which is what makes streaming through a chain of nodes
+ * deadlock free. A failed write switches the pump to discarding its
+ * input, so the peer writing to us is still drained.
+ * 
+ * The run ends early when the deadline passes or a pump fails in a way
+ * listed in its abort_on. The unfinished pumps are then finished without
+ * sending their FRAME_END, so the peers see the stream cut short.
+ * 
+ * @param pumps 
+ * @param count 
+ * @param deadline nowMs() based time to give up at, 0 for none
+ * @return int PUMPS_OK, PUMPS_FAILED, PUMPS_TIMEOUT or PUMPS_ABORTED
+ */
+int runPumps(struct pump *pumps, int count, long long deadline)
+{
+  struct pollfd fds[count];
+  int owner[count];
+  int flags[2 * count];
+  int status = PUMPS_OK;
+
+  for (int i = 0; i < count; i++)
+  {
+    struct pump *p = &pumps[i];
+    flags[2 * i] = p->in_fd >= 0 ? fcntl(p->in_fd, F_GETFL) : -1;
+    flags[2 * i + 1] = p->out_fd >= 0 ? fcntl(p->out_fd, F_GETFL) : -1;
+    if (flags[2 * i] != -1)
+      fcntl(p->in_fd, F_SETFL, flags[2 * i] | O_NONBLOCK);
+    if (flags[2 * i + 1] != -1)
+      fcntl(p->out_fd, F_SETFL, flags[2 * i + 1] | O_NONBLOCK);
+  }
+
+  while (status == PUMPS_OK)
+  {
+    int nfds = 0;
+    int pending = 0;
+    for (int i = 0; i < count; i++)
+    {
+      struct pump *p = &pumps[i];
+      bool wants_input = servicePump(p);
+      if (p->done && !p->watching)
+        continue;
+      fds[nfds].fd = wants_input || p->done ? p->in_fd : p->out_fd;
+      fds[nfds].events = wants_input || p->done ? POLLIN : POLLOUT;
+      owner[nfds++] = i;
+      if (!p->done)
+        pending++;
+    }
+    if (pending == 0)
+      break;
+
+    int timeout = -1;
+    if (deadline > 0)
+    {
+      long long left = deadline - nowMs();
+      if (left <= 0)
+      {
+        status = PUMPS_TIMEOUT;
+        break;
+      }
+      timeout = (int)left;
+    }
+
+    if (poll(fds, nfds, timeout) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("[runPumps] poll error");
+      break;
+    }
+
+    for (int j = 0; j < nfds; j++)
+    {
+      struct pump *p = &pumps[owner[j]];
+      if (fds[j].revents == 0)
+        continue;
+
+      if (p->watching)
+        watchPump(p);
+      else if (fds[j].events == POLLIN)
+        readPump(p);
+      else
+      {
+        ssize_t n = write(p->out_fd, p->chunk + p->off, p->len);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+          continue;
+        if (n == -1)
+        {
+          // peer went away, keep draining the input so the writer on the
+          // other side does not get stuck
+          p->write_failed = true;
+          p->discard = true;
+          continue;
+        }
+        p->off += n;
+        p->len -= n;
+      }
+
+      if (pumpAborts(p))
+        status = PUMPS_ABORTED;
+    }
+  }
+
+  // restore in reverse order, pumps may share fds
+  for (int i = count - 1; i >= 0; i--)
+  {
+    struct pump *p = &pumps[i];
+    bool closed = p->done && p->on_eof == PUMP_CLOSE;
+    if (!p->done)
+      finishPump(p);
+    p->watching = false;
+    if (flags[2 * i + 1] != -1 && !closed && p->on_eof != PUMP_CLOSE)
+      fcntl(p->out_fd, F_SETFL, flags[2 * i + 1]);
+    if (flags[2 * i] != -1)
+      fcntl(p->in_fd, F_SETFL, flags[2 * i]);
+    if (status == PUMPS_OK && (p->read_failed || p->write_failed))
+      status = PUMPS_FAILED;
+  }
+  return status;
+}
+
+/**
+ * @brief Milliseconds on the monotonic clock, used for deadlines
+ * 
+ * @return long long 
+ */
+long long nowMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Parse a duration like 500ms, 5s, 2m (or a plain number of seconds)
+ * 
+ * @param str 
+ * @return int duration in milliseconds, -1 if invalid
+ */
+int parseDuration(char *str)
+{
+  char *end;
+  while (*str == ' ')
+    str++;
+  long value = strtol(str, &end, 10);
+  if (end == str || value < 0)
+    return -1;
+  while (*end == ' ')
+    end++;
+
+  long scale;
+  if (strncmp(end, "ms", 2) == 0)
+  {
+    scale = 1;
+    end += 2;
+  }
+  else if (*end == 's' || *end == 'm')
+  {
+    scale = *end == 's' ? 1000 : 60 * 1000;
+    end++;
+  }
+  else
+    scale = 1000;
+  while (*end == ' ' || *end == '\n')
+    end++;
+  if (*end != '\0' && *end != ']')
+    return -1;
+  if (value > INT_MAX / scale)
+    return -1;
+  return (int)(value * scale);
+}
@@ -10,15 +10,46 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include "lz.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // iovecs per writev on Linux, limits.h only has it for X/Open
+#endif
 
 #define TCP_BACKLOG 5
 #define CLIENT_PORT 8000
 #define CONFIG_FILE_PATH "./config.txt"
+#define UNIX_SOCKET_TEMPLATE "/tmp/clustershell_%d.sock" // where a node listens next to its port
+#define UNIX_PATH_SIZE sizeof(((struct sockaddr_un *)0)->sun_path)
 #define MAX_CLIENTS_ALLOWED 100
 #define MAX_COMMAND_SIZE 1024
 #define MAX_OUTPUT_SIZE 1024
+#define MAX_STDERR_SIZE 65536
+#define HEARTBEAT_INTERVAL 2 // seconds between heartbeats sent by a node
+#define HEARTBEAT_TIMEOUT 6  // a node missing heartbeats this long is dead
+#define TIMEOUT_GRACE_MS 1000 // extra time the server gives nodes to report a timeout
+#define MAX_HEADER_SIZE 8192
+#define MAX_HOPS 32
+#define PUMP_CHUNK_SIZE 4096
+#define ZIP_MIN_STREAM 65536 // output a pump sends before it starts compressing frames
+#define ZIP_MIN_FRAME 256    // smaller frames are not worth compressing
+
+// what a pump does with its output fd once its input is exhausted
+#define PUMP_KEEP 0
+#define PUMP_CLOSE 1
+#define PUMP_SHUTDOWN 2
 
 void assert(bool condition, char *error_string, int fd1, int fd2);
 
@@ -26,16 +57,33 @@ void errExit(char *err, int fd1, int fd2);
 
 int serverSetup(int port);
 
+int heartbeatSetup(int port);
+
+int unixServerSetup(char *path);
+
 typedef struct
 {
   char **data;
   int count;
 } parsed_config;
 
+// machine of a command: n<machine> if positive, 0 for broadcast (n*),
+// -1 for the local machine and MACHINE_ANY for the least loaded (nany/nleast)
+#define MACHINE_ANY -2
+
+// how the input of a n* command is shared between the nodes
+#define PARTITION_NONE 0  // every node gets the whole input (broadcast)
+#define PARTITION_SPLIT 1 // every node gets a contiguous run of lines
+#define PARTITION_HASH 2  // lines are spread by their hash
+
 struct command
 {
   char *cmd;
   int machine;
+  bool cmd_owned; // cmd was allocated by the planner and has to be freed
+  int timeout_ms; // deadline of the command (eg: n2[5s].ls), 0 for none
+  int partition;  // how a n* command splits its input (eg: n*/split.grep a)
+  bool sort_merge; // merge the sorted outputs of the nodes (eg: n*/split+sort.sort)
   struct command *next;
 };
 
@@ -46,6 +94,149 @@ struct command_pipe
   int count;
 };
 
+// growable byte buffer used for stage inputs/outputs held on the server
+struct buffer
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+// data gathered from several nodes (eg: the output of a broadcast), one
+// buffer per node tagged with the node. The parts are kept apart and
+// written out with writev, so they are never copied into one buffer.
+struct buffer_part
+{
+  int node; // node the data came from, 0 if none
+  struct buffer data;
+};
+
+struct buffer_list
+{
+  struct buffer_part *parts;
+  int count;
+  int cap;
+  size_t len; // bytes in all parts
+};
+
+// a stage of a node-to-node chain (pointers into a header). An ip
+// starting with / is the path of the Unix socket of the node.
+struct hop
+{
+  int node;
+  char *ip;
+  int port;
+  int timeout_ms;
+  char *cmd;
+  char *path; // server side: Unix socket of a node co-located with the server, or NULL
+};
+
+// request received by a clustershell_client: the command to run, the
+// node number it runs as and the hops its stdout should be streamed through.
+// A broadcast sent down a relay tree also lists the nodes of the subtree
+// the receiver forwards it to, fanout of them directly (see handleRelay).
+struct stage_request
+{
+  char header[MAX_HEADER_SIZE + 1];
+  char *cmd;
+  int node;
+  int timeout_ms;
+  struct hop hops[MAX_HOPS];
+  int hop_count;
+  struct hop relays[MAX_CLIENTS_ALLOWED];
+  int relay_count;
+  int fanout;
+  bool zip; // the requester takes compressed frames (ZIP 1), and sends them
+};
+
+// Everything sent after a request header is a sequence of frames. The
+// input of a command is sent as FRAME_DATA frames ending with FRAME_END.
+// A node answers with the FRAME_DATA frames of its stdout, then
+// FRAME_ERR frames with its stderr and a FRAME_STATUS frame
+// ("exit=<code> ... state=<ok|timeout|cancelled|busy>"). Closing a
+// connection before its FRAME_END (or while the command still runs)
+// cancels the command, and the node passes the cancellation on.
+// On the wire the header is packed into FRAME_HEADER_SIZE bytes: type (1),
+// flags (1), node (2) and payload length (4), in network byte order.
+// A request header with a ZIP 1 line lets both sides compress the payload
+// of large FRAME_DATA frames (see lz.h), which is flagged with
+// FRAME_COMPRESSED. Decoders expand such frames wherever they come from.
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_PAYLOAD (PUMP_CHUNK_SIZE - FRAME_HEADER_SIZE)
+#define FRAME_DATA 1
+#define FRAME_ERR 2
+#define FRAME_STATUS 3
+#define FRAME_END 4
+#define FRAME_COMPRESSED 1 // flag: the payload is compressed
+
+struct frame_header
+{
+  int type;
+  int flags;
+  int node;
+  int len;
+};
+
+// a failure of the pump that ends runPumps for all pumps right away
+#define PUMP_ABORT_READ 1
+#define PUMP_ABORT_WRITE 2
+
+// runPumps results
+#define PUMPS_OK 0
+#define PUMPS_FAILED -1
+#define PUMPS_TIMEOUT -2
+#define PUMPS_ABORTED -3
+
+// pump modes
+#define PUMP_RAW 0    // copy bytes as they are
+#define PUMP_ENCODE 1 // wrap the input into FRAME_DATA frames
+#define PUMP_DECODE 2 // unwrap FRAME_DATA frames, other frames go to on_frame
+
+// moves bytes from an fd (or src buffer) to an fd (or dst buffer)
+// without blocking the other pumps running alongside it
+struct pump
+{
+  int in_fd;
+  int out_fd;
+  struct buffer *src;
+  struct buffer_list *src_list; // read part after part instead of src
+  int src_part;
+  size_t src_off;
+  struct buffer *dst;
+  size_t dst_limit; // input beyond this many bytes in dst is dropped, 0 for no limit
+  int on_eof;
+  int mode;
+  int frame_node; // encode: node written in the frame headers
+  bool end_frame; // encode: send FRAME_END at eof, decode: input must end with FRAME_END
+  bool watch_eof; // decode: after FRAME_END, treat the peer closing in_fd as a read failure
+  bool demux;     // decode: hand FRAME_DATA frames to on_frame too, instead of the output
+  int abort_on;   // PUMP_ABORT_READ and/or PUMP_ABORT_WRITE
+  bool compress;  // encode: compress frames once ZIP_MIN_STREAM bytes were sent
+  size_t bytes;   // bytes moved so far, frame headers included when encoding or decoding
+  void (*on_frame)(struct frame_header *hdr, char *payload, void *arg);
+  void *frame_arg;
+  char chunk[PUMP_CHUNK_SIZE]; // pending output
+  size_t off;
+  size_t len;
+  char raw[PUMP_CHUNK_SIZE]; // decode: input not decoded yet
+  size_t raw_off;
+  size_t raw_len;
+  char hdr_bytes[FRAME_HEADER_SIZE]; // decode: frame being read
+  size_t hdr_len;
+  struct frame_header hdr;
+  size_t payload_left;
+  char frame[MAX_FRAME_PAYLOAD];
+  size_t frame_len;
+  bool end_sent;
+  bool end_seen;
+  bool eof;
+  bool discard;
+  bool done;
+  bool watching;
+  bool read_failed;
+  bool write_failed;
+};
+
 parsed_config *parseConfigFile();
 
 void resetConfigObj(parsed_config *config);
@@ -58,6 +249,58 @@ void createCommandPipe(char *cmd_input, struct command_pipe *cmd_pipe);
 
 void printCommandPipe(struct command_pipe *cmd_pipe);
 
+bool isChangeDir(char *cmd);
+
+void planCommandPipe(struct command_pipe *cmd_pipe, int local_machine);
+
+int formatCommandPipe(struct command_pipe *cmd_pipe, char *buf, int size);
+
 int clientSetup(char *addr, int port, int arg_fd);
 
+int clientConnect(char *addr, int port);
+
+void bufferInit(struct buffer *buf);
+
+void bufferAppend(struct buffer *buf, const char *data, size_t len);
+
+void bufferFree(struct buffer *buf);
+
+void bufferListInit(struct buffer_list *list);
+
+void bufferListAdd(struct buffer_list *list, int node, struct buffer *buf);
+
+void bufferListAppend(struct buffer_list *list, int node, const char *data, size_t len);
+
+void bufferListFree(struct buffer_list *list);
+
+int writeBufferList(int fd, struct buffer_list *list);
+
+int writeAll(int fd, const char *data, size_t len);
+
+int writeRequestHeader(int fd, struct hop *hops, int hop_count, struct hop *relays, int relay_count, int fanout, bool zip);
+
+int readRequestHeader(int fd, struct stage_request *req, int *len);
+
+pid_t spawnCommand(char *cmd, int *in_fd, int *out_fd, int *err_fd);
+
+void appendFrames(struct buffer *buf, int type, int node, const char *payload, size_t len);
+
+void packFrameHeader(char *buf, int type, int node, int len);
+
+void unpackFrameHeader(char *buf, struct frame_header *hdr);
+
+int writeFrames(int fd, int type, int node, const char *payload, size_t len);
+
+void initPump(struct pump *p, int in_fd, int out_fd, int on_eof);
+
+int runPumps(struct pump *pumps, int count, long long deadline);
+
+long long nowMs();
+
+void partitionLines(struct buffer_list *input, int mode, struct buffer *parts, int count);
+
+void mergeSortedLines(struct buffer *inputs, int count, struct buffer *merged);
+
+int parseDuration(char *str);
+
 #endif
\ No newline at end of file
@@ -10,20 +10,39 @@
 #include <time.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "message.h"
+#include "transport.h"
 
 #define MESSAGE_TYPE_GROUP 1
 #define MESSAGE_TYPE_CLIENT 2
+#define MAX_PARTIALS 64
 
 char server_queue_path[1024];
 char client_queue_path[1024];
 char client_name[1024];
 
-int server_queue;
 int client_queue, group_queue, private_queue;
 
 int recvtype;
+long reading;   // mtype of the conversation being read
+
+// A message whose fragments are being put together, one per sender since a
+// sender sends the fragments of a message one after the other. Kept in a
+// chain of the bucket of the sender once it sent a first fragment.
+typedef struct Partials {
+    int  src;
+    int  seq;
+    int  frags;     // fragments received so far
+    int  len;
+    char content[MAX_CONTENT + 1];
+    struct Partials* next;
+} Partial;
+
+Partial* partials[MAX_PARTIALS];
 
 int
 get_autodelete_val(char pair[]) {
@@ -76,10 +95,7 @@ init_connection() {
 
     // printf("%s\n", client_queue_path);
 
-    key_t skey = ftok("/tmp/simplemsg/server.queue", 1);
-    server_queue = msgget(skey, 0777 | IPC_CREAT);
-    if (server_queue < 0) {
-        perror("msgget");
+    if (transport_connect() < 0) {
         return -1;
     }
 
@@ -117,7 +133,7 @@ register_self(char name[], char queuepath[]) {
 
     int size = sizeof(cmsg) - sizeof(long);
     // printf("\n\nsize = %d | size2 = %d | size3 = %d\n\n", size, size2, size3);
-    int status = msgsnd(server_queue, &cmsg, size, 0);
+    int status = transport_send(&cmsg, size);
     if (status < 0) {
         perror("msgsnd");
         return -1;
@@ -153,8 +169,8 @@ int get_gid(char group_name[]) {
     query.query_type = QUERY_GROUP;
     query.src = getuid();
     sprintf(query.content, "%s", group_name);
-    int qsize = sizeof(query) - sizeof(long);
-    int qstat = msgsnd(server_queue, &query, qsize, 0);
+    int qsize = QUERY_SIZE(QueryRequest, query);
+    int qstat = transport_send(&query, qsize);
     if (qstat < 0) {
         perror("msgsnd");
         printf("Unable to send group query\n");
@@ -188,8 +204,8 @@ int get_cid(char client_name[]) {
     query.query_type = QUERY_CLIENT;
     query.src = getuid();
     strcpy(query.content, client_name);
-    int qsize = sizeof(query) - sizeof(long);
-    int qstat = msgsnd(server_queue, &query, qsize, 0);
+    int qsize = QUERY_SIZE(QueryRequest, query);
+    int qstat = transport_send(&query, qsize);
     if (qstat < 0) {
         perror("msgsnd");
         printf("Unable to send client query\n");
@@ -234,7 +250,7 @@ join_group(char group_name[]) {
     cmsg.src = getuid();
 
     int size = sizeof(cmsg) - sizeof(long);
-    int status = msgsnd(server_queue, &cmsg, size, 0);
+    int status = transport_send(&cmsg, size);
     if (status < 0) {
         perror("msgsnd");
         printf("Unable to send group join request\n");
@@ -267,7 +283,7 @@ create_group(char group_name[]) {
     cmsg.src = getuid();
     
     int size = sizeof(cmsg) - sizeof(long);
-    int status = msgsnd(server_queue, &cmsg, size, 0);
+    int status = transport_send(&cmsg, size);
     if (status < 0) {
         perror("msgsnd");
         printf("Unable to send group create request\n");
@@ -293,42 +309,89 @@ create_group(char group_name[]) {
     return gid;
 }
 
-void*
-handle_messages() {
-    int mtype = getuid() + 5000;
-    while (1) {
-        Message msg;
-        int size = sizeof(msg) - sizeof(long); 
-        int status = msgrcv(server_queue, (void*)&msg, size, mtype, 0);
-        if (status < 0) {
-            perror("handle_messages > msgrcv");
-            return NULL;
-        }
+// Tells the server that a reader of the conversation (its mtype) starts or
+// stops. The server holds the messages of a conversation while no reader
+// runs for it and drops those that expire meanwhile. Only READER_ONLINE
+// gets a response.
+int
+set_reader(int action) {
+    ControlMessage cmsg;
+    cmsg.mtype = CONTROL;
+    cmsg.action = action;
+    cmsg.src = getuid();
+    cmsg.reading = reading;
 
-        if (msg.auto_delete > 0) {
-            long tstamp = (long)time(NULL);
-            if (tstamp - msg.timestamp > msg.auto_delete) {
-                continue;
-            }
-        }
+    int size = sizeof(cmsg) - sizeof(long);
+    int status = transport_send(&cmsg, size);
+    if (status < 0) {
+        perror("msgsnd");
+        return -1;
+    }
+    if (action == READER_OFFLINE) {
+        return 0;
+    }
 
-        if (msg.protocol == GROUP_MESSAGE) {
-            msg.mtype = 5000 + msg.dst;
-            int status = msgsnd(client_queue, &msg, size, 0);
-            if (status < 0) {
-                perror("handle_messages > GROUP_MESSAGE msgsnd");
-                return NULL;
-            }
-        }
-        else if (msg.protocol == CLIENT_MESSAGE) {
-            msg.mtype = 10000 + msg.src;
-            int status = msgsnd(client_queue, &msg, size, 0);
-            if (status < 0) {
-                perror("handle_messages > CLIENT_MESSAGE msgsnd");
-                return NULL;
-            }
+    ControlResponse cres;
+    size = sizeof(cres) - sizeof(long);
+    status = msgrcv(client_queue, (void*)&cres, size, CONTROL_RESPONSE, 0);
+    if (status < 0) {
+        perror("msgrcv");
+        return -1;
+    }
+
+    return cres.status == STATUS_OK ? 0 : -1;
+}
+
+void
+stop_reader(int sig) {
+    (void)sig;
+    set_reader(READER_OFFLINE);
+    _exit(0);
+}
+
+// Drops a reference to the slot, never below 0
+void
+release_slot(RingSlot* slot) {
+    int refs = __atomic_load_n(&slot->refs, __ATOMIC_ACQUIRE);
+    while (refs > 0 && !__atomic_compare_exchange_n(&slot->refs, &refs, refs - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+RingSlot*
+open_ring() {
+    int fd = shm_open(RING_NAME, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    RingSlot* ring = (RingSlot*)mmap(NULL, sizeof(RingSlot) * RING_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+// Sends the content to the server, or to our own queue, in as many
+// fragments as it takes, each carrying the name of the sender and only
+// the bytes in use
+int
+send_fragments(int to_self, Message* msg, char content[]) {
+    int name_len = strlen(client_name) + 1;
+    int piece = MAX_BODY - name_len;
+    int len = strlen(content);
+    msg->frags = len == 0 ? 1 : (len + piece - 1) / piece;
+
+    for (msg->frag = 0; msg->frag < msg->frags; msg->frag++) {
+        int off = msg->frag * piece;
+        int n = len - off < piece ? len - off : piece;
+        memcpy(msg->body, client_name, name_len);
+        memcpy(msg->body + name_len, content + off, n);
+        msg->body_len = name_len + n;
+        int status = to_self ? msgsnd(client_queue, (void*)msg, MESSAGE_SIZE(*msg), 0)
+                             : transport_send(msg, MESSAGE_SIZE(*msg));
+        if (status < 0) {
+            return -1;
         }
     }
+
+    return 0;
 }
 
 int
@@ -344,21 +407,24 @@ start_message_send_loop(char name[], int type, int autodelete) {
     }
 
     long auto_delete = -1;
+    int seq = 0;
 
     while (1) {
         Message msg;
+        char content[MAX_CONTENT + 1];
         msg.protocol = (int)mtype;
         msg.src = getuid();
         msg.dst = dst;
         msg.auto_delete = autodelete;
         msg.timestamp = (long)time(NULL);
-        strcpy(msg.src_name, client_name);
-        fgets(msg.content, sizeof(msg.content), stdin);
+        msg.seq = seq++;
+        if (fgets(content, sizeof(content), stdin) == NULL) {
+            return 0;
+        }
 
-        int msgsize = sizeof(msg) - sizeof(long);
         if (type == MESSAGE_TYPE_CLIENT) {
             msg.mtype = dst + 10000;
-            int status = msgsnd(client_queue, (void*)&msg, msgsize, 0);
+            int status = send_fragments(1, &msg, content);
             if (status < 0) {
                 perror("msgsnd");
                 printf("Failed to send message to self-queue\n");
@@ -367,7 +433,7 @@ start_message_send_loop(char name[], int type, int autodelete) {
         }
 
         msg.mtype = mtype;
-        int status = msgsnd(server_queue, (void*)(&msg), msgsize, 0);
+        int status = send_fragments(0, &msg, content);
         if (status < 0) {
             perror("msgsnd");
             printf("Unable to send message. Exiting\n");
@@ -379,14 +445,64 @@ start_message_send_loop(char name[], int type, int autodelete) {
     return 0;
 }
 
+// Adds the fragment to the message of its sender. Returns the content once
+// the message is complete, NULL until then or if the fragment is corrupt.
+char*
+add_fragment(Message* msg) {
+    char* name = msg->body;
+    int name_len = strnlen(name, msg->body_len) + 1;
+    if (msg->body_len < name_len || msg->body_len > MAX_BODY || msg->frag < 0 || msg->frag >= msg->frags) {
+        return NULL;
+    }
+
+    Partial** bucket = &partials[(unsigned)msg->src % MAX_PARTIALS];
+    Partial* part = *bucket;
+    while (part != NULL && part->src != msg->src) {
+        part = part->next;
+    }
+    if (part == NULL) {
+        if (msg->frag != 0) {
+            return NULL; // the start of the message was missed
+        }
+        part = (Partial*)calloc(1, sizeof(Partial));
+        if (part == NULL) {
+            return NULL;
+        }
+        part->next = *bucket;
+        *bucket = part;
+    }
+
+    if (msg->frag == 0) {
+        part->src = msg->src;
+        part->seq = msg->seq;
+        part->frags = 0;
+        part->len = 0;
+    }
+    else if (part->seq != msg->seq || part->frags != msg->frag) {
+        return NULL; // the start of the message was missed
+    }
+
+    int n = msg->body_len - name_len;
+    if (part->len + n > MAX_CONTENT) {
+        n = MAX_CONTENT - part->len;
+    }
+    memcpy(part->content + part->len, name + name_len, n);
+    part->len += n;
+    part->content[part->len] = '\0';
+    part->frags++;
+
+    return part->frags == msg->frags ? part->content : NULL;
+}
+
 int
 start_message_rcv_loop(char name[], int type) {
     int mtype;
     char queue_path[1024];
     
     recvtype = type;
-    pthread_t router_thread;
 
+    // The server delivers into our own queue, with the mtype of the group
+    // or of the sender, so the kernel hands us only this conversation
     if (type == MESSAGE_TYPE_CLIENT) {
         mtype = get_cid(name) + 10000;
     }
@@ -394,21 +510,73 @@ start_message_rcv_loop(char name[], int type) {
         mtype = get_gid(name) + 5000;
     }
 
-    pthread_create(&router_thread, NULL, handle_messages, NULL);
+    RingSlot* ring = open_ring();
 
-    printf("Listening for messages, press Ctrl+C to stop\n");
+    reading = mtype;
+    signal(SIGINT, stop_reader);
+    signal(SIGTERM, stop_reader);
 
+    // What a killed reader of the conversation left in the queue is taken
+    // before going online, the queue may have no room for the answer
+    int online = 0;
     while (1) {
         Message msg;
         int size = sizeof(msg) - sizeof(long);
-        int status = msgrcv(client_queue, (void*)&msg, size, mtype, 0);
+        int status = msgrcv(client_queue, (void*)&msg, size, mtype, online ? 0 : IPC_NOWAIT);
+        if (status < 0 && !online && errno == ENOMSG) {
+            if (set_reader(READER_ONLINE) < 0) {
+                printf("Unable to go online\n");
+                return -1;
+            }
+            online = 1;
+            printf("Listening for messages, press Ctrl+C to stop\n");
+            continue;
+        }
         if (status < 0) {
             perror("msgrcv");
+            set_reader(READER_OFFLINE);
             return -1;
         }
+
+        // A group message left in the ring: copy it out and release the slot
+        if (msg.protocol == GROUP_MESSAGE_SLOT) {
+            SlotNotice notice = *(SlotNotice*)&msg;
+            if (ring == NULL) {
+                ring = open_ring();
+            }
+            if (ring == NULL || notice.slot < 0 || notice.slot >= RING_SLOTS) {
+                continue;
+            }
+            // a stale notice holds no reference, the slot may be someone else's
+            RingSlot* slot = &ring[notice.slot];
+            if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != notice.gen) {
+                continue;
+            }
+            msg = slot->msg;
+            // reclaimed by the server while copying: the copy may be torn
+            if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != notice.gen) {
+                continue;
+            }
+            release_slot(slot);
+        }
+        else {
+            msg.body_len = status - (int)(offsetof(Message, body) - sizeof(long));
+        }
+
+        if (msg.auto_delete > 0) {
+            long tstamp = (long)time(NULL);
+            if (tstamp - msg.timestamp > msg.auto_delete) {
+                continue;
+            }
+        }
+        char* content = add_fragment(&msg);
+        if (content == NULL) {
+            continue;
+        }
+
         time_t tstamp = (time_t)msg.timestamp;
         struct tm tm = *localtime(&tstamp);
-        printf("[%s\t at %02d:%02d] %s", msg.src_name, tm.tm_hour, tm.tm_min, msg.content);
+        printf("[%s\t at %02d:%02d] %s", msg.body, tm.tm_hour, tm.tm_min, content);
     }
 
     return 0;
@@ -421,8 +589,8 @@ list_query(int type) {
     query.query_type = type;
     query.src = getuid();
     strcpy(query.content, "_ALL_");
-    int qsize = sizeof(query) - sizeof(long);
-    int qstat = msgsnd(server_queue, &query, qsize, 0);
+    int qsize = QUERY_SIZE(QueryRequest, query);
+    int qstat = transport_send(&query, qsize);
     if (qstat < 0) {
         perror("msgsnd");
         printf("Unable to send group query\n");
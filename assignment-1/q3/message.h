@@ -1,4 +1,8 @@
+#include <stddef.h>
+
 #define MAX_LEN 128
+#define MAX_BODY (3 * MAX_LEN)      // sender name and content carried by one queue message
+#define MAX_CONTENT (32 * MAX_LEN)  // longest content, sent in fragments of MAX_BODY
 
 // Protocols
 #define CLIENT_MESSAGE 1
@@ -9,6 +13,18 @@
 #define QUERY_RESPONSE 6
 #define CONTROL 7
 #define CONTROL_RESPONSE 8
+#define GROUP_MESSAGE_SLOT 9
+
+// Shared memory ring for group messages: the server writes a group message
+// once into a slot and sends every member a SlotNotice with the index and
+// the generation of the slot. The last member to copy the message out
+// frees the slot. A notice whose generation is not that of its slot is
+// stale (left from an earlier ring or server) and is skipped. A slot
+// whose readers never release it (killed, or without the ring) is reused
+// once its message expires, or RING_SLOT_TTL seconds after it was written.
+#define RING_NAME "/simplemsg.ring"
+#define RING_SLOTS 1024
+#define RING_SLOT_TTL 60
 
 // Query Types
 #define QUERY_CLIENT 1
@@ -19,11 +35,17 @@
 #define JOIN_GROUP 2
 #define LEAVE_GROUP 3
 #define CREATE_GROUP 4
+#define READER_ONLINE 5     // a reader starts, messages can be delivered
+#define READER_OFFLINE 6    // a reader stops, no response is sent
 
 // Control Statuses
 #define STATUS_OK 200
 #define STATUS_ERROR 500
 
+// Only the header and the body_len bytes in use of the body are sent, see
+// MESSAGE_SIZE. The body holds the name of the sender (null terminated)
+// followed by the piece of content of the fragment. Content longer than a
+// body is sent as frags fragments sharing the seq of the message.
 typedef struct Messages {
     long  mtype;
     int  protocol;
@@ -32,10 +54,20 @@ typedef struct Messages {
     long auto_delete;
     long timestamp;
     int  status;
-    char src_name[MAX_LEN];
-    char content[2 * MAX_LEN];
+    int  seq;       // messages of a sender are numbered
+    int  frag;      // index of this fragment, from 0
+    int  frags;     // number of fragments of the message
+    int  body_len;
+    char body[MAX_BODY];
 } Message;
 
+// Bytes to pass msgsnd for a message
+#define MESSAGE_SIZE(msg) (offsetof(Message, body) - sizeof(long) + (msg).body_len)
+
+// Bytes to pass msgsnd for a query request or response: the content is
+// sent up to its null character
+#define QUERY_SIZE(type, query) (offsetof(type, content) - sizeof(long) + strlen((query).content) + 1)
+
 typedef struct QueryRequests {
     long  mtype;
     int  protocol;
@@ -57,6 +89,7 @@ typedef struct ControlMessages {
     int  action;
     int  src;
     int  gid;                // For joining or leaving groups
+    long reading;            // For readers going online or offline: the mtype they read
 } ControlMessage;
 
 typedef struct ControlResponse {
@@ -64,4 +97,18 @@ typedef struct ControlResponse {
     long action;
     int status;
     int gid;
-} ControlResponse;
\ No newline at end of file
+} ControlResponse;
+
+typedef struct RingSlots {
+    int  refs;   // members yet to copy the message, 0 if the slot is free
+    long gen;    // changes every time the slot is claimed
+    long reclaim; // time() from which the slot is free even if refs > 0
+    Message msg;
+} RingSlot;
+
+typedef struct SlotNotices {
+    long mtype;
+    int  protocol;  // GROUP_MESSAGE_SLOT, where Message has its protocol
+    int  slot;
+    long gen;       // generation of the slot the notice is for
+} SlotNotice;
\ No newline at end of file
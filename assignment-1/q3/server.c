@@ -8,13 +8,75 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "message.h"
+#include "transport.h"
 
 #define MAX 1024
 #define MAX_GROUPS 32
-
-
+#define MAX_READING 32      // conversations a client reads at the same time
+#define INDEX_SIZE 4096
+#define BATCH_SIZE 64       // messages a routing handler takes off the queue at once
+#define STATS_INTERVAL 10   // seconds between routing stats reports
+#define FLUSH_INTERVAL_MS 10 // how often held messages and responses are retried
+#define OUTBOUND_LIMIT 4096 // undelivered messages kept per client, the oldest go first
+#define READER_STALL_SECONDS 5 // a full queue nobody received from this long has no live reader
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)  // slots per level of the timing wheel
+#define WHEEL_LEVELS 3                 // seconds, 64s and 4096s per slot
+#define LOG_DIR "/tmp/simplemsg/log"
+#define DIRECTORY_FILE LOG_DIR "/directory"
+#define SEGMENT_SIZE (1 << 20)  // bytes of messages per log segment
+#define ENTRY_DONE 0
+#define ENTRY_PENDING 1
+
+
+
+// Start of the index of the message log, followed by the entries
+typedef struct LogHeaders {
+    long base;          // id of the first entry in the file
+    long count;         // entries in the file
+    int segment;        // segment being appended to
+    int segment_len;
+} LogHeader;
+
+// A message held in the log for a client. A group message is written once
+// and has an entry per member it is held for.
+typedef struct LogEntries {
+    int cid;
+    int state;
+    int segment;
+    int offset;
+    long expires;
+} LogEntry;
+
+// Where a message is in the log, segment is -1 until it is written
+typedef struct LogRefs {
+    int segment;
+    int offset;
+} LogRef;
+
+// A message the server holds for a client: in the client's outbound buffer
+// and, if it expires, in the timing wheel
+typedef struct Pendings {
+    Message msg;
+    long entry;         // id of its entry in the message log, -1 if none
+    long expires;       // time() from which it is expired, 0 if never
+    int size;           // bytes to send of a response, 0 for a message
+    int level;          // slot of the timing wheel it is in
+    int slot;
+    struct Clients* clt;
+    struct Pendings* prev;         // outbound buffer of the client
+    struct Pendings* next;
+    struct Pendings* timer_prev;   // slot of the timing wheel
+    struct Pendings* timer_next;
+} Pending;
 
 typedef struct Clients {
     int cid;
@@ -23,22 +85,90 @@ typedef struct Clients {
     int queue;
     int num_groups;
     int groups[MAX_GROUPS][2];
+    struct Clients* next_by_id;   // chains of the client indexes
+    struct Clients* next_by_name;
+    int num_reading;              // conversations a reader runs for
+    long reading[MAX_READING][3]; // mtype of the conversation, its readers, and time() the last came online
+    Pending* outbound_head;       // messages not delivered yet, oldest first
+    Pending* outbound_tail;
+    int outbound_len;
+    Pending* responses_head;      // responses that did not fit in its queue yet
+    Pending* responses_tail;
 } Client;
 
 typedef struct Groups {
     int gid;
     char name[MAX];
     int num_clients;
-    Client* clients[MAX];
+    int max_clients;
+    Client** clients;
+    struct Groups* next_by_id;    // chains of the group indexes
+    struct Groups* next_by_name;
 } Group;
 
 
-Client* clients[MAX];
-Group* groups[MAX];
+Client** clients;
+Group** groups;
 int next_group_id = 0;
 int total_clients = 0;
 int total_groups = 0;
-int server_queue;
+int max_clients = 0;
+int max_groups = 0;
+
+// Hash indexes of the clients and groups by id and by name, so that routing
+// a message does not scan every client or group
+Client* clients_by_id[INDEX_SIZE];
+Client* clients_by_name[INDEX_SIZE];
+Group* groups_by_id[INDEX_SIZE];
+Group* groups_by_name[INDEX_SIZE];
+
+// Guards all of the above. The routing and query handlers only read the
+// directory and share the lock, the control handler takes it exclusively
+// to register clients and create or join groups. Nobody sends a message
+// while holding it, so a full client queue cannot stall the directory.
+pthread_rwlock_t directory_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Messages are delivered to a client only while a reader of their
+// conversation (their mtype) runs and its queue has room, so that nothing
+// sits in a client queue that nobody reads. Until then they wait in its
+// outbound buffer,
+// and those with an auto delete time are dropped once expired, so they
+// never take space in a client queue. The timing wheel finds the expired
+// messages without scanning the buffers: level l has a slot per 64^l
+// seconds, and a timer moves down a level when the time of its slot comes.
+// outbound_lock guards the buffers, the wheel and Client.reading.
+pthread_mutex_t outbound_lock = PTHREAD_MUTEX_INITIALIZER;
+Pending* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+long wheel_now;
+long expired_total = 0;
+
+// Messages held for clients are also written to an append-only log, so
+// that they survive a restart of the server. The log is a series of
+// segment files holding the messages, and an index mapped in memory with
+// an entry per message and client. A client's entries still pending are
+// where its delivery resumes after a restart. The directory is saved
+// next to the log, so that groups keep their gid and the logged messages
+// still go to the right group. A segment is deleted once none of its
+// entries is pending, and the index drops the entries done at its start.
+// Guarded by outbound_lock.
+// Group messages sent as ring notices are not logged: the ring and the
+// client queues holding the notices outlive the server, which reuses the
+// ring when it restarts. They are lost only if the ring itself is gone.
+LogHeader* log_index;
+long log_capacity = 0;      // entries the mapping of the index has room for
+int index_fd = -1;
+int segment_fd = -1;
+int* segment_live;          // entries pending per segment
+int max_segments = 0;
+long recovered = 0;         // entries pending from before the restart
+int loading_directory = 0;
+FILE* directory_log;        // the directory file, changes are appended to it
+
+// Ring of group message slots shared with the clients, see message.h. Only
+// the group handler claims slots.
+RingSlot* ring;
+int next_slot = 0;
+long next_gen;  // from the clock, so that it never repeats one of an earlier run
 
 void 
 append_trailing_slash(char str[]) {
@@ -60,7 +190,7 @@ init_dirs() {
 
 Client* 
 new_client(int cid, char name[], char qpath[]) {
-    Client* client = (Client*)malloc(sizeof(Client));
+    Client* client = (Client*)calloc(1, sizeof(Client));
     client->cid = cid;
     sprintf(client->name, "%s", name);
     sprintf(client->queue_path, "%s", qpath);
@@ -70,119 +200,844 @@ new_client(int cid, char name[], char qpath[]) {
 
 Group*
 new_group(int gid, char name[]) {
-    Group* group = (Group*)malloc(sizeof(Group));
+    Group* group = (Group*)calloc(1, sizeof(Group));
     group->gid = gid;
     sprintf(group->name, "%s", name);
 
     return group;
 }
 
-Group* 
-find_group_by_id(int id) {
-    if (id < total_groups && groups[id]->gid == id) {
-        return groups[id];
+unsigned int
+hash_id(int id) {
+    return ((unsigned int)id * 2654435761u) % INDEX_SIZE;
+}
+
+unsigned int
+hash_name(char name[]) {
+    unsigned int hash = 5381;
+    for (int i = 0; name[i] != '\0'; i++) {
+        hash = hash * 33 + (unsigned char)name[i];
     }
-    for (int i = 0; i < total_groups; i++) {
-        if (groups[i]->gid == id) return groups[i];
+
+    return hash % INDEX_SIZE;
+}
+
+void*
+grow_array(void* array, int* capacity, int size) {
+    *capacity = *capacity == 0 ? MAX : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL) {
+        perror("realloc");
+        exit(-1);
     }
 
-    return NULL;
+    return array;
+}
+
+// Clients and groups are added at the end of their chains, so that a name
+// used twice keeps resolving to the first one, as it did with the scans
+void
+add_client(Client* client) {
+    if (total_clients == max_clients) {
+        clients = grow_array(clients, &max_clients, sizeof(Client*));
+    }
+    clients[total_clients++] = client;
+
+    Client** link = &clients_by_id[hash_id(client->cid)];
+    while (*link != NULL) link = &(*link)->next_by_id;
+    *link = client;
+
+    link = &clients_by_name[hash_name(client->name)];
+    while (*link != NULL) link = &(*link)->next_by_name;
+    *link = client;
+}
+
+void
+add_group(Group* group) {
+    if (total_groups == max_groups) {
+        groups = grow_array(groups, &max_groups, sizeof(Group*));
+    }
+    groups[total_groups++] = group;
+
+    Group** link = &groups_by_id[hash_id(group->gid)];
+    while (*link != NULL) link = &(*link)->next_by_id;
+    *link = group;
+
+    link = &groups_by_name[hash_name(group->name)];
+    while (*link != NULL) link = &(*link)->next_by_name;
+    *link = group;
+}
+
+Group* 
+find_group_by_id(int id) {
+    Group* grp = groups_by_id[hash_id(id)];
+    while (grp != NULL && grp->gid != id) grp = grp->next_by_id;
+
+    return grp;
 }
 
 Group*
 find_group_by_name(char name[]) {
-    printf("Total groups = %d\n", total_groups);
-    printf("Target name = %s\n", name);
-    for (int i = 0; i < total_groups; i++) {
-        printf("i = %d | name = %s\n", i, groups[0]->name);
-        if (strcmp(groups[i]->name, name) == 0) {
-            return groups[i];
-        }
-    }
+    Group* grp = groups_by_name[hash_name(name)];
+    while (grp != NULL && strcmp(grp->name, name) != 0) grp = grp->next_by_name;
 
-    return NULL;
+    return grp;
 }
 
 Client*
 find_client_by_id(int id) {
-    for (int i = 0; i < total_clients; i++) {
-        if (clients[i]->cid == id) return clients[i];
-    }
+    Client* clt = clients_by_id[hash_id(id)];
+    while (clt != NULL && clt->cid != id) clt = clt->next_by_id;
 
-    return NULL;
+    return clt;
 }
 
 Client*
 find_client_by_name(char name[]) {
-    for (int i = 0; i < total_clients; i++) {
-        if (strcmp(clients[i]->name, name) == 0) {
-            return clients[i];
-        }
-    }
+    Client* clt = clients_by_name[hash_name(name)];
+    while (clt != NULL && strcmp(clt->name, name) != 0) clt = clt->next_by_name;
 
-    return NULL;
+    return clt;
 }
 
 
-int
-send_group_message(Group* grp, Message msg_buf) {
-    int num_clients = grp->num_clients;
-    
-    msg_buf.protocol = GROUP_MESSAGE;
+// Copies the members of the group, so that the message can be sent to
+// them without holding the directory lock (which the caller holds for the
+// lookup). Clients are never removed, the copy stays valid. Returns NULL if
+// there is no such group.
+Client**
+get_group_members(int gid, int* num_members) {
+    Group* grp = find_group_by_id(gid);
+    Client** members = NULL;
+    if (grp != NULL) {
+        *num_members = grp->num_clients;
+        members = (Client**)malloc(sizeof(Client*) * (grp->num_clients + 1));
+        memcpy(members, grp->clients, sizeof(Client*) * grp->num_clients);
+    }
+
+    return members;
+}
 
-    for (int i = 0; i < num_clients; i++) {
-        msg_buf.mtype = grp->clients[i]->cid + 5000;
-        int size = sizeof(msg_buf) - sizeof(msg_buf.mtype);
-        int status = msgsnd(server_queue, &msg_buf, size, 0);
+// Maps the ring, the one of the previous run if it is still there, since
+// client queues may hold notices for its slots
+int
+init_ring() {
+    struct stat st;
+    int fd = shm_open(RING_NAME, O_RDWR, 0666);
+    if (fd >= 0 && (fstat(fd, &st) < 0 || st.st_size != sizeof(RingSlot) * RING_SLOTS)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        shm_unlink(RING_NAME);
+        fd = shm_open(RING_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd < 0) {
+            perror("shm_open");
+            return -1;
+        }
+        fchmod(fd, 0666); // clients of every user attach to it
+        int status = ftruncate(fd, sizeof(RingSlot) * RING_SLOTS);
         if (status < 0) {
-            perror("msgsnd");
+            perror("ftruncate");
+            close(fd);
             return -1;
         }
-        printf("Message sent to %s, queue=%d\n", clients[i]->name, server_queue);
     }
 
+    ring = (RingSlot*)mmap(NULL, sizeof(RingSlot) * RING_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        ring = NULL;
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    next_gen = (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
     return 0;
 }
 
+// Returns a free slot of the ring, or -1 if every slot still holds a
+// message some member has not read. A slot past its reclaim time is free:
+// the members that did not release it are gone or will skip the notice.
 int
-send_client_message(Client* clt, Message msg_buf) {
-    msg_buf.mtype = CLIENT_MESSAGE;
-    msg_buf.protocol = CLIENT_MESSAGE;
-    msg_buf.mtype = clt->cid + 5000;
-    int size = sizeof(msg_buf) - sizeof(msg_buf.mtype);
-    int status = msgsnd(server_queue, &msg_buf, size, 0);
-    if (status < 0) {
-        perror("msgsnd");
+claim_slot(long now) {
+    if (ring == NULL) {
         return -1;
     }
+    for (int i = 0; i < RING_SLOTS; i++) {
+        int slot = (next_slot + i) % RING_SLOTS;
+        if (__atomic_load_n(&ring[slot].refs, __ATOMIC_ACQUIRE) <= 0 || ring[slot].reclaim <= now) {
+            next_slot = (slot + 1) % RING_SLOTS;
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+#define LOG_ENTRY(id) (((LogEntry*)(log_index + 1))[(id) - log_index->base])
+
+void
+segment_path(int segment, char path[]) {
+    sprintf(path, "%s/%08d.seg", LOG_DIR, segment);
+}
+
+int
+map_index(long capacity) {
+    size_t size = sizeof(LogHeader) + capacity * sizeof(LogEntry);
+    if (ftruncate(index_fd, size) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    if (log_capacity > 0) {
+        munmap(log_index, sizeof(LogHeader) + log_capacity * sizeof(LogEntry));
+    }
+    log_index = (LogHeader*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (log_index == MAP_FAILED) {
+        perror("mmap");
+        log_index = NULL;
+        log_capacity = 0;
+        return -1;
+    }
+    log_capacity = capacity;
 
     return 0;
 }
 
 int
-send_query_response(Client* clt, QueryResponse qres) {
-    int size = sizeof(qres) - sizeof(qres.mtype);
-    int status = msgsnd(clt->queue, &qres, size, 0);
-    if (status < 0) {
-        perror("msgsnd");
+open_segment(int segment) {
+    char path[MAX];
+    segment_path(segment, path);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("open");
+    }
+
+    return fd;
+}
+
+void
+count_live(int segment, int delta) {
+    while (segment >= max_segments) {
+        int old = max_segments;
+        segment_live = grow_array(segment_live, &max_segments, sizeof(int));
+        memset(segment_live + old, 0, sizeof(int) * (max_segments - old));
+    }
+    segment_live[segment] += delta;
+}
+
+// Opens the log left by the previous run, or starts a new one, and counts
+// the entries still pending in it
+int
+init_log() {
+    mkdir(LOG_DIR, 0700);
+    index_fd = open(LOG_DIR "/log.index", O_RDWR | O_CREAT, 0600);
+    if (index_fd < 0) {
+        perror("open");
         return -1;
     }
+    struct stat st;
+    fstat(index_fd, &st);
+    int fresh = st.st_size < (long)sizeof(LogHeader);
+    long capacity = fresh ? 1024 : (st.st_size - sizeof(LogHeader)) / sizeof(LogEntry);
+    if (map_index(capacity < 1024 ? 1024 : capacity) < 0) {
+        return -1;
+    }
+    if (fresh) {
+        memset(log_index, 0, sizeof(LogHeader));
+    }
+
+    for (long id = log_index->base; id < log_index->base + log_index->count; id++) {
+        if (LOG_ENTRY(id).state == ENTRY_PENDING) {
+            count_live(LOG_ENTRY(id).segment, 1);
+            recovered++;
+        }
+    }
+    count_live(log_index->segment, 0);
+    segment_fd = open_segment(log_index->segment);
+    if (segment_fd < 0) {
+        return -1;
+    }
+    printf("Message log has %ld pending messages\n", recovered);
 
     return 0;
 }
 
+// Writes the message at the end of the log, unless it is there already
 int
-send_control_response(Client* clt, ControlResponse cres) {
-    int size = sizeof(cres) - sizeof(long);
-    int status = msgsnd(clt->queue, &cres, size, 0);
-    if (status < 0) {
-        perror("msgsnd");
+log_append(Message* msg, LogRef* ref) {
+    if (ref->segment >= 0) {
+        return 0;
+    }
+    if (segment_fd < 0) {
+        return -1;
+    }
+
+    int size = MESSAGE_SIZE(*msg) + sizeof(long);
+    if (log_index->segment_len + size > SEGMENT_SIZE) {
+        close(segment_fd);
+        if (segment_live[log_index->segment] == 0) {
+            char path[MAX];
+            segment_path(log_index->segment, path);
+            unlink(path);
+        }
+        log_index->segment++;
+        log_index->segment_len = 0;
+        count_live(log_index->segment, 0);
+        segment_fd = open_segment(log_index->segment);
+        if (segment_fd < 0) {
+            return -1;
+        }
+    }
+
+    // written past the length in the header, a crash before the header is
+    // updated leaves the message out of the log
+    int status = pwrite(segment_fd, msg, size, log_index->segment_len);
+    if (status != size) {
+        perror("pwrite");
+        return -1;
+    }
+    ref->segment = log_index->segment;
+    ref->offset = log_index->segment_len;
+    log_index->segment_len += size;
+
+    return 0;
+}
+
+// Adds an entry holding the message in the log for the client. Returns its
+// id, or -1 if the message could not be logged.
+long
+log_add(Client* clt, Message* msg, LogRef* ref, long expires) {
+    if (log_index == NULL || log_append(msg, ref) < 0) {
         return -1;
     }
+    if (log_index->count == log_capacity && map_index(log_capacity * 2) < 0) {
+        return -1;
+    }
+
+    long id = log_index->base + log_index->count;
+    LogEntry* entry = &LOG_ENTRY(id);
+    entry->cid = clt->cid;
+    entry->segment = ref->segment;
+    entry->offset = ref->offset;
+    entry->expires = expires;
+    entry->state = ENTRY_PENDING;
+    count_live(ref->segment, 1);
+    log_index->count++;
+
+    return id;
+}
+
+// The message was delivered, expired or dropped: the client's delivery no
+// longer resumes from it
+void
+log_done(long id) {
+    if (id < 0 || log_index == NULL) {
+        return;
+    }
+    LogEntry* entry = &LOG_ENTRY(id);
+    entry->state = ENTRY_DONE;
+    count_live(entry->segment, -1);
+    if (segment_live[entry->segment] == 0 && entry->segment != log_index->segment) {
+        char path[MAX];
+        segment_path(entry->segment, path);
+        unlink(path);
+    }
+}
+
+// Drops the entries done at the start of the index once they are at least
+// half of it. Entry ids do not change.
+void
+compact_log() {
+    if (log_index == NULL) {
+        return;
+    }
+    long done = 0;
+    while (done < log_index->count && LOG_ENTRY(log_index->base + done).state == ENTRY_DONE) done++;
+    if (done == 0 || done * 2 < log_index->count) {
+        return;
+    }
+
+    LogEntry* entries = (LogEntry*)(log_index + 1);
+    memmove(entries, entries + done, sizeof(LogEntry) * (log_index->count - done));
+    log_index->base += done;
+    log_index->count -= done;
+}
+
+void
+wheel_add(Pending* p) {
+    long delta = p->expires - wheel_now;
+    long max_delta = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (delta < 1) delta = 1;
+    if (delta > max_delta) delta = max_delta; // fires early and is added again
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1L << (WHEEL_BITS * (level + 1)))) level++;
+    p->level = level;
+    p->slot = ((wheel_now + delta) >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    p->timer_prev = NULL;
+    p->timer_next = wheel[level][p->slot];
+    if (p->timer_next != NULL) p->timer_next->timer_prev = p;
+    wheel[level][p->slot] = p;
+}
+
+void
+wheel_remove(Pending* p) {
+    if (p->timer_prev != NULL) p->timer_prev->timer_next = p->timer_next;
+    else wheel[p->level][p->slot] = p->timer_next;
+    if (p->timer_next != NULL) p->timer_next->timer_prev = p->timer_prev;
+}
+
+// Takes the message out of its client's outbound buffer and frees it
+void
+drop_pending(Pending* p) {
+    Client* clt = p->clt;
+    if (p->prev != NULL) p->prev->next = p->next;
+    else clt->outbound_head = p->next;
+    if (p->next != NULL) p->next->prev = p->prev;
+    else clt->outbound_tail = p->prev;
+    clt->outbound_len--;
+
+    if (p->expires > 0) {
+        wheel_remove(p);
+    }
+    log_done(p->entry);
+    free(p);
+}
+
+// Moves the wheel on to now, one second at a time, and drops the messages
+// that expire on the way. Returns the number of messages dropped.
+int
+wheel_advance(long now) {
+    int expired = 0;
+    while (wheel_now < now) {
+        wheel_now++;
+
+        // higher levels first, so that a timer can move down several levels
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (wheel_now & ((1L << (WHEEL_BITS * (top + 1))) - 1)) == 0) top++;
+        for (int level = top; level >= 1; level--) {
+            int slot = (wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            Pending* p = wheel[level][slot];
+            wheel[level][slot] = NULL;
+            while (p != NULL) {
+                Pending* next = p->timer_next;
+                wheel_add(p);
+                p = next;
+            }
+        }
+
+        int slot = wheel_now & (WHEEL_SLOTS - 1);
+        Pending* p = wheel[0][slot];
+        wheel[0][slot] = NULL;
+        while (p != NULL) {
+            Pending* next = p->timer_next;
+            if (p->expires <= wheel_now) {
+                p->expires = 0; // out of the wheel already
+                drop_pending(p);
+                expired++;
+            }
+            else {
+                wheel_add(p);
+            }
+            p = next;
+        }
+    }
+    expired_total += expired;
+
+    return expired;
+}
+
+int
+is_expired(Message* msg, long now) {
+    return msg->auto_delete > 0 && now - msg->timestamp > msg->auto_delete;
+}
+
+int
+is_reading(Client* clt, long mtype) {
+    for (int i = 0; i < clt->num_reading; i++) {
+        if (clt->reading[i][0] == mtype) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Whether the outbound buffer of the client holds a message of the mtype,
+// which a new one must not overtake
+int
+has_pending(Client* clt, long mtype) {
+    for (Pending* p = clt->outbound_head; p != NULL; p = p->next) {
+        if (p->msg.mtype == mtype) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Counts a reader of the mtype in or out. Returns -1 if the client reads
+// too many conversations already.
+int
+set_reading(Client* clt, long mtype, int delta) {
+    int i = 0;
+    while (i < clt->num_reading && clt->reading[i][0] != mtype) i++;
+    if (i == clt->num_reading) {
+        if (delta < 0) {
+            return 0;
+        }
+        if (clt->num_reading == MAX_READING) {
+            return -1;
+        }
+        clt->reading[i][0] = mtype;
+        clt->reading[i][1] = 0;
+        clt->num_reading++;
+    }
+
+    clt->reading[i][1] += delta;
+    if (delta > 0) {
+        clt->reading[i][2] = time(NULL);
+    }
+    if (clt->reading[i][1] <= 0) {
+        clt->num_reading--;
+        clt->reading[i][0] = clt->reading[clt->num_reading][0];
+        clt->reading[i][1] = clt->reading[clt->num_reading][1];
+        clt->reading[i][2] = clt->reading[clt->num_reading][2];
+    }
+
+    return 0;
+}
+
+// Adds the message to the client's outbound buffer, before the message
+// held in before, or at the end if it is NULL. Must hold outbound_lock.
+void
+buffer_message(Client* clt, Message* msg, long entry, long expires, Pending* before) {
+    if (clt->outbound_len == OUTBOUND_LIMIT) {
+        printf("Outbound buffer of %s is full, dropping its oldest message\n", clt->name);
+        if (before == clt->outbound_head) before = before->next;
+        drop_pending(clt->outbound_head);
+    }
+    Pending* p = (Pending*)calloc(1, sizeof(Pending));
+    p->msg = *msg;
+    p->clt = clt;
+    p->entry = entry;
+    p->expires = expires;
+    p->next = before;
+    p->prev = before != NULL ? before->prev : clt->outbound_tail;
+    if (p->prev != NULL) p->prev->next = p;
+    else clt->outbound_head = p;
+    if (p->next != NULL) p->next->prev = p;
+    else clt->outbound_tail = p;
+    clt->outbound_len++;
+    if (p->expires > 0) {
+        wheel_add(p);
+    }
+}
+
+// Takes the messages of mtype a killed reader left in the client's queue
+// back to the front of its outbound buffer, and releases the ring slots of
+// the notices among them, so that the queue has room for the responses
+// the client waits on. Must hold outbound_lock.
+void
+take_back(Client* clt, long mtype) {
+    Pending* first = clt->outbound_head;
+    long now = time(NULL);
+    int taken = 0;
+    Message msg;
+    int status;
+    while ((status = msgrcv(clt->queue, &msg, sizeof(msg) - sizeof(long), mtype, IPC_NOWAIT)) >= 0) {
+        if (msg.protocol == GROUP_MESSAGE_SLOT) {
+            SlotNotice notice = *(SlotNotice*)&msg;
+            if (ring == NULL || notice.slot < 0 || notice.slot >= RING_SLOTS ||
+                __atomic_load_n(&ring[notice.slot].gen, __ATOMIC_ACQUIRE) != notice.gen) {
+                continue;
+            }
+            msg = ring[notice.slot].msg;
+            __atomic_sub_fetch(&ring[notice.slot].refs, 1, __ATOMIC_ACQ_REL);
+        }
+        else {
+            msg.body_len = status - (int)(offsetof(Message, body) - sizeof(long));
+        }
+        if (is_expired(&msg, now)) {
+            continue;
+        }
+
+        LogRef ref = { -1, 0 };
+        long expires = msg.auto_delete > 0 ? msg.timestamp + msg.auto_delete + 1 : 0;
+        buffer_message(clt, &msg, log_add(clt, &msg, &ref, expires), expires, first);
+        taken++;
+    }
+    printf("Took back %d messages from the queue of %s\n", taken, clt->name);
+}
+
+// The client's queue is full. If nothing was received from it since the
+// reader of mtype came online, or for READER_STALL_SECONDS, the reader was
+// killed before it could go offline: its messages wait for a new one.
+// Must hold outbound_lock.
+void
+queue_full(Client* clt, long mtype) {
+    int i = 0;
+    while (i < clt->num_reading && clt->reading[i][0] != mtype) i++;
+    struct msqid_ds stat;
+    if (i == clt->num_reading || msgctl(clt->queue, IPC_STAT, &stat) < 0) {
+        return;
+    }
+    long last = stat.msg_rtime > clt->reading[i][2] ? stat.msg_rtime : clt->reading[i][2];
+    if (time(NULL) - last >= READER_STALL_SECONDS) {
+        printf("Queue of %s is full and nobody reads it, conversation %ld is offline\n", clt->name, mtype);
+        set_reading(clt, mtype, -clt->reading[i][1]);
+        take_back(clt, mtype);
+    }
+}
+
+// Sends the responses the client's queue had no room for, then the
+// messages of its outbound buffer, oldest first, as long as the client is
+// online and its queue has room. Must hold outbound_lock.
+void
+flush_outbound(Client* clt) {
+    while (clt->responses_head != NULL) {
+        Pending* p = clt->responses_head;
+        int status = msgsnd(clt->queue, &p->msg, p->size, IPC_NOWAIT);
+        if (status < 0) {
+            if (errno != EAGAIN) perror("msgsnd");
+            return;
+        }
+        clt->responses_head = p->next;
+        if (clt->responses_head == NULL) clt->responses_tail = NULL;
+        free(p);
+    }
+
+    // messages of conversations nobody reads stay, the others keep their order
+    Pending* p = clt->num_reading > 0 ? clt->outbound_head : NULL;
+    while (p != NULL) {
+        Pending* next = p->next;
+        if (is_reading(clt, p->msg.mtype)) {
+            int status = msgsnd(clt->queue, &p->msg, MESSAGE_SIZE(p->msg), IPC_NOWAIT);
+            if (status < 0) {
+                if (errno != EAGAIN) perror("msgsnd");
+                else queue_full(clt, p->msg.mtype);
+                return;
+            }
+            drop_pending(p);
+        }
+        p = next;
+    }
+}
+
+// Sends the message to the client right away if a reader of its mtype
+// runs, nothing of that mtype is waiting before it and its queue has room, or else keeps it in the
+// client's outbound buffer and in the log. ref is where the message is in
+// the log, so that a group message is written there once. Must hold
+// outbound_lock.
+void
+deliver(Client* clt, Message* msg, LogRef* ref) {
+    if (is_reading(clt, msg->mtype) && !has_pending(clt, msg->mtype)) {
+        int status = msgsnd(clt->queue, msg, MESSAGE_SIZE(*msg), IPC_NOWAIT);
+        if (status == 0) {
+            return;
+        }
+        if (errno != EAGAIN) {
+            perror("msgsnd");
+            return;
+        }
+        queue_full(clt, msg->mtype);
+    }
+
+    long expires = msg->auto_delete > 0 ? msg->timestamp + msg->auto_delete + 1 : 0;
+    buffer_message(clt, msg, log_add(clt, msg, ref, expires), expires, NULL);
+}
+
+// Puts the messages the log holds for the client back in its outbound
+// buffer, when it registers after a restart of the server. Must hold
+// outbound_lock.
+void
+resume_client(Client* clt) {
+    if (recovered == 0) {
+        return;
+    }
+    long now = time(NULL);
+    int resumed = 0;
+    for (long id = log_index->base; id < log_index->base + log_index->count; id++) {
+        LogEntry* entry = &LOG_ENTRY(id);
+        if (entry->cid != clt->cid || entry->state != ENTRY_PENDING) {
+            continue;
+        }
+        recovered--;
+        if (entry->expires > 0 && entry->expires <= now) {
+            log_done(id);
+            continue;
+        }
+
+        Message msg;
+        char path[MAX];
+        segment_path(entry->segment, path);
+        int fd = open(path, O_RDONLY);
+        int head = offsetof(Message, body);
+        int read_ok = fd >= 0 && pread(fd, &msg, head, entry->offset) == head &&
+                      msg.body_len >= 0 && msg.body_len <= MAX_BODY &&
+                      pread(fd, msg.body, msg.body_len, entry->offset + head) == msg.body_len;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!read_ok) {
+            printf("Lost a logged message for %s\n", clt->name);
+            log_done(id);
+            continue;
+        }
+        buffer_message(clt, &msg, id, entry->expires, NULL);
+        resumed++;
+    }
+    if (resumed > 0) {
+        printf("Resumed %d logged messages for %s\n", resumed, clt->name);
+    }
+}
+
+// Writes the message once into a ring slot and sends the members that can
+// take it right away a small notice with the slot. The others get the
+// whole message through their outbound buffers, as does everyone if the
+// ring is full. Everything goes straight into the member's own queue,
+// with the mtype its reader of the group waits on (5000 + gid).
+int
+send_group_message(Client* members[], int num_members, Message msg_buf) {
+    msg_buf.protocol = GROUP_MESSAGE;
+    msg_buf.mtype = msg_buf.dst + 5000;
+    long now = time(NULL);
+    if (is_expired(&msg_buf, now)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&outbound_lock);
+    int slot = num_members > 0 ? claim_slot(now) : -1;
+    int notified = 0;
+    long gen = next_gen++;
+    if (slot >= 0) {
+        // the new generation goes in first, so that a late reader of the
+        // old one skips the slot instead of releasing the new message
+        __atomic_store_n(&ring[slot].gen, gen, __ATOMIC_RELEASE);
+        ring[slot].msg = msg_buf;
+        ring[slot].reclaim = now + RING_SLOT_TTL;
+        if (msg_buf.auto_delete > 0 && msg_buf.timestamp + msg_buf.auto_delete + 1 < ring[slot].reclaim) {
+            ring[slot].reclaim = msg_buf.timestamp + msg_buf.auto_delete + 1;
+        }
+        __atomic_store_n(&ring[slot].refs, num_members, __ATOMIC_RELEASE);
+    }
+
+    LogRef ref = { -1, 0 };
+    SlotNotice notice;
+    notice.mtype = msg_buf.mtype;
+    notice.protocol = GROUP_MESSAGE_SLOT;
+    notice.slot = slot;
+    notice.gen = gen;
+    for (int i = 0; i < num_members; i++) {
+        Client* clt = members[i];
+        if (slot >= 0 && is_reading(clt, msg_buf.mtype) && !has_pending(clt, msg_buf.mtype) &&
+            msgsnd(clt->queue, &notice, sizeof(notice) - sizeof(notice.mtype), IPC_NOWAIT) == 0) {
+            notified++;
+            continue;
+        }
+        deliver(clt, &msg_buf, &ref);
+    }
+    if (slot >= 0 && notified < num_members) {
+        // only the members notified release the slot
+        __atomic_sub_fetch(&ring[slot].refs, num_members - notified, __ATOMIC_ACQ_REL);
+    }
+    pthread_mutex_unlock(&outbound_lock);
 
+    printf("Message sent to %d of %d members through slot %d\n", notified, num_members, slot);
     return 0;
 }
 
+// Sends the message to the client's own queue, with the mtype its reader
+// of the sender waits on (10000 + src)
+int
+send_client_message(Client* clt, Message msg_buf) {
+    msg_buf.protocol = CLIENT_MESSAGE;
+    msg_buf.mtype = msg_buf.src + 10000;
+    if (is_expired(&msg_buf, time(NULL))) {
+        return 0;
+    }
+
+    LogRef ref = { -1, 0 };
+    pthread_mutex_lock(&outbound_lock);
+    deliver(clt, &msg_buf, &ref);
+    pthread_mutex_unlock(&outbound_lock);
+
+    return 0;
+}
+
+// Expires the messages held for clients, retries delivering the rest and
+// the responses, and compacts the log. Runs every FLUSH_INTERVAL_MS, so
+// that a reader catching up is not held to a queue full a second.
+void
+tick_timers() {
+    pthread_rwlock_rdlock(&directory_lock);
+    pthread_mutex_lock(&outbound_lock);
+    int expired = wheel_advance(time(NULL));
+    for (int i = 0; i < total_clients; i++) {
+        flush_outbound(clients[i]);
+    }
+    compact_log();
+    pthread_mutex_unlock(&outbound_lock);
+    pthread_rwlock_unlock(&directory_lock);
+
+    if (expired > 0) {
+        printf("Expired %d undelivered messages (%ld so far)\n", expired, expired_total);
+    }
+}
+
+void*
+handle_timers() {
+    while (1) {
+        usleep(FLUSH_INTERVAL_MS * 1000);
+        tick_timers();
+    }
+}
+
+// Sends a response without waiting for room in the client's queue: a
+// client that does not empty its queue must not hold up the handler, and
+// with it every other client. A response that does not fit waits in the
+// client's responses and is retried with its held messages.
+int
+send_response(Client* clt, void* res, int size) {
+    pthread_mutex_lock(&outbound_lock);
+    if (clt->responses_head == NULL) {
+        int status = msgsnd(clt->queue, res, size, IPC_NOWAIT);
+        if (status == 0 || errno != EAGAIN) {
+            pthread_mutex_unlock(&outbound_lock);
+            if (status < 0) {
+                perror("msgsnd");
+            }
+            return status;
+        }
+    }
+
+    Pending* p = (Pending*)calloc(1, sizeof(Pending));
+    memcpy(&p->msg, res, size + sizeof(long));
+    p->size = size;
+    p->entry = -1;
+    p->clt = clt;
+    if (clt->responses_tail != NULL) clt->responses_tail->next = p;
+    else clt->responses_head = p;
+    clt->responses_tail = p;
+    pthread_mutex_unlock(&outbound_lock);
+
+    return 0;
+}
+
+int
+send_query_response(Client* clt, QueryResponse qres) {
+    return send_response(clt, &qres, QUERY_SIZE(QueryResponse, qres));
+}
+
+int
+send_control_response(Client* clt, ControlResponse cres) {
+    return send_response(clt, &cres, sizeof(cres) - sizeof(long));
+}
+
 int
 get_queue(key_t key) {
     int queue = msgget(key, 0777 | IPC_CREAT);
@@ -196,6 +1051,43 @@ get_queue(key_t key) {
     return queue;
 }
 
+// Writes the clients, groups and members, one per line with tab separated
+// fields, so that a restarted server knows them and groups keep their gid.
+// Done once at start up, to drop the lines the changes appended since.
+void
+compact_directory() {
+    FILE* f = fopen(DIRECTORY_FILE ".tmp", "w");
+    if (f == NULL) {
+        perror("fopen");
+        return;
+    }
+    for (int i = 0; i < total_clients; i++) {
+        fprintf(f, "client\t%d\t%s\t%s\n", clients[i]->cid, clients[i]->queue_path, clients[i]->name);
+    }
+    for (int i = 0; i < total_groups; i++) {
+        fprintf(f, "group\t%d\t%s\n", groups[i]->gid, groups[i]->name);
+        for (int j = 0; j < groups[i]->num_clients; j++) {
+            fprintf(f, "member\t%d\t%d\n", groups[i]->gid, groups[i]->clients[j]->cid);
+        }
+    }
+    fclose(f);
+    rename(DIRECTORY_FILE ".tmp", DIRECTORY_FILE);
+}
+
+// Appends a change of the directory, a line as compact_directory writes
+// them. Loading the file replays the lines in order.
+void
+save_directory(const char* format, ...) {
+    if (loading_directory || directory_log == NULL) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(directory_log, format, ap);
+    va_end(ap);
+    fflush(directory_log);
+}
+
 Client*
 register_client(int uid, char name[], char queuepath[]) {
     printf("Inside register_client\n");
@@ -226,7 +1118,12 @@ register_client(int uid, char name[], char queuepath[]) {
 
     printf("Client created\n");
 
-    clients[total_clients++] = client;
+    add_client(client);
+
+    pthread_mutex_lock(&outbound_lock);
+    resume_client(client);
+    pthread_mutex_unlock(&outbound_lock);
+    save_directory("client\t%d\t%s\t%s\n", client->cid, client->queue_path, client->name);
 
     printf("Client added to db\n");
 
@@ -236,9 +1133,18 @@ register_client(int uid, char name[], char queuepath[]) {
 
 int
 join_group(Group* grp, Client* clt) {
+    // members are saved across restarts, joining again changes nothing
+    for (int i = 0; i < grp->num_clients; i++) {
+        if (grp->clients[i] == clt) {
+            return grp->gid;
+        }
+    }
     clt->num_groups = clt->num_groups + 1;
 
     // Add client to group data structure
+    if (grp->num_clients == grp->max_clients) {
+        grp->clients = grow_array(grp->clients, &grp->max_clients, sizeof(Client*));
+    }
     grp->clients[grp->num_clients] = clt;
     grp->num_clients += 1;
 
@@ -250,7 +1156,7 @@ Group*
 create_group(char name[], Client* creator) {
     // Create Group struct and update relevant data structures
     Group* group = new_group(next_group_id++, name);
-    groups[total_groups++] = group;
+    add_group(group);
 
     int status = join_group(group, creator);
     if (status < 0) {
@@ -263,36 +1169,233 @@ create_group(char name[], Client* creator) {
 
 
 
+// Registers again the clients, groups and members saved by the previous
+// run. The clients get their logged messages back right away. Then opens
+// the file for the changes to come.
+void
+load_directory() {
+    FILE* f = fopen(DIRECTORY_FILE, "r");
+    if (f == NULL) {
+        directory_log = fopen(DIRECTORY_FILE, "a");
+        return;
+    }
+    loading_directory = 1;
+    char line[3 * MAX];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char* kind = strtok(line, "\t");
+        char* id = strtok(NULL, "\t");
+        char* field = strtok(NULL, "\t");
+        char* name = strtok(NULL, "\t");
+        if (kind == NULL || id == NULL || field == NULL) {
+            continue;
+        }
+
+        if (strcmp(kind, "client") == 0 && name != NULL) {
+            register_client(atoi(id), name, field);
+        }
+        else if (strcmp(kind, "group") == 0) {
+            add_group(new_group(atoi(id), field));
+            if (atoi(id) >= next_group_id) {
+                next_group_id = atoi(id) + 1;
+            }
+        }
+        else if (strcmp(kind, "member") == 0) {
+            Group* grp = find_group_by_id(atoi(id));
+            Client* clt = find_client_by_id(atoi(field));
+            if (grp != NULL && clt != NULL) {
+                join_group(grp, clt);
+            }
+        }
+    }
+    fclose(f);
+    loading_directory = 0;
+    printf("Loaded %d clients and %d groups\n", total_clients, total_groups);
+
+    compact_directory();
+    directory_log = fopen(DIRECTORY_FILE, "a");
+}
+
+// Messages are only as long as their body, take its length from the number
+// of bytes received rather than trusting the sender
+int
+set_body_len(Message* msg, int received) {
+    msg->body_len = received - (int)(offsetof(Message, body) - sizeof(long));
+    if (msg->body_len < 0) {
+        printf("Dropped a message of %d bytes, too short\n", received);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Counters of a routing handler
+typedef struct RouteStats {
+    char* name;
+    long batches;
+    long messages;
+    int max_batch;
+    long long busy_us;  // time spent routing batches
+    long long max_us;   // longest batch
+    time_t last_report;
+} RouteStats;
+
+long long
+now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Waits for a message of the given type (unless wait is 0), then takes
+// whatever else of that type is already queued, up to BATCH_SIZE messages.
+// Returns the number of messages, -1 on error.
+int
+receive_batch(Message batch[], long mtype, int wait) {
+    int n = 0;
+    while (n < BATCH_SIZE) {
+        int size = sizeof(batch[n]) - sizeof(batch[n].mtype);
+        int status = transport_receive(mtype, &batch[n], size, wait && n == 0);
+        if (status < 0) {
+            if (errno == ENOMSG || errno == EINTR) {
+                if (n > 0 || !wait) break;
+                continue;
+            }
+            perror("msgrcv");
+            return -1;
+        }
+        if (set_body_len(&batch[n], status) == 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+// Orders the batch by destination, keeping the order of the messages to a
+// destination (the fragments of a message must stay in order), and
+// returns the number of destinations. run_start[i] is the position in
+// order of the first message to the i-th destination.
+int
+group_by_dst(Message batch[], int n, Message* order[], int run_start[]) {
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        while (j > 0 && order[j - 1]->dst > batch[i].dst) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = &batch[i];
+    }
+
+    int runs = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || order[i]->dst != order[i - 1]->dst) {
+            run_start[runs++] = i;
+        }
+    }
+    run_start[runs] = n;
+
+    return runs;
+}
+
+void
+record_batch(RouteStats* stats, int n, long long started) {
+    long long took = now_us() - started;
+    stats->batches++;
+    stats->messages += n;
+    stats->busy_us += took;
+    if (n > stats->max_batch) stats->max_batch = n;
+    if (took > stats->max_us) stats->max_us = took;
+
+    time_t now = time(NULL);
+    if (now - stats->last_report >= STATS_INTERVAL) {
+        printf("[%s routing] batches = %ld | messages = %ld | avg batch = %.1f | max batch = %d | avg batch time = %lldus | max batch time = %lldus\n",
+            stats->name, stats->batches, stats->messages, (double)stats->messages / stats->batches, stats->max_batch,
+            stats->busy_us / stats->batches, stats->max_us);
+        stats->last_report = now;
+    }
+}
+
+void
+route_group_batch(Message batch[], int n) {
+    static RouteStats stats = {.name = "group"};
+    Message* order[BATCH_SIZE];
+    int run_start[BATCH_SIZE + 1];
+    Client** members[BATCH_SIZE];
+    int num_members[BATCH_SIZE];
+    long long started = now_us();
+    int runs = group_by_dst(batch, n, order, run_start);
+
+    // One lookup per group, all under a single lock
+    pthread_rwlock_rdlock(&directory_lock);
+    for (int r = 0; r < runs; r++) {
+        members[r] = get_group_members(order[run_start[r]]->dst, &num_members[r]);
+    }
+    pthread_rwlock_unlock(&directory_lock);
+
+    for (int r = 0; r < runs; r++) {
+        if (members[r] == NULL) {
+            printf("No group with gid = %d\n", order[run_start[r]]->dst);
+            continue;
+        }
+        printf("Forwarding %d messages to group %d\n", run_start[r + 1] - run_start[r], order[run_start[r]]->dst);
+        for (int i = run_start[r]; i < run_start[r + 1]; i++) {
+            send_group_message(members[r], num_members[r], *order[i]);
+        }
+        free(members[r]);
+    }
+    record_batch(&stats, n, started);
+}
+
+void
+route_client_batch(Message batch[], int n) {
+    static RouteStats stats = {.name = "client"};
+    Message* order[BATCH_SIZE];
+    int run_start[BATCH_SIZE + 1];
+    Client* dst_clients[BATCH_SIZE];
+    long long started = now_us();
+    int runs = group_by_dst(batch, n, order, run_start);
+
+    // Clients are never removed, so they stay valid after the lock
+    pthread_rwlock_rdlock(&directory_lock);
+    for (int r = 0; r < runs; r++) {
+        dst_clients[r] = find_client_by_id(order[run_start[r]]->dst);
+    }
+    pthread_rwlock_unlock(&directory_lock);
+
+    for (int r = 0; r < runs; r++) {
+        if (dst_clients[r] == NULL) {
+            printf("No client with cid = %d\n", order[run_start[r]]->dst);
+            continue;
+        }
+        for (int i = run_start[r]; i < run_start[r + 1]; i++) {
+            send_client_message(dst_clients[r], *order[i]);
+        }
+    }
+    record_batch(&stats, n, started);
+}
+
 void* 
 handle_group_send_msgs() {
+    static Message batch[BATCH_SIZE];
     while (1) {
-        Message msg;
-        int size = sizeof(msg) - sizeof(msg.mtype);
-        int status = msgrcv(server_queue, &msg, size, GROUP_MESSAGE, 0);
-        if (status < 0) {
-            perror("msgrcv");
+        int n = receive_batch(batch, GROUP_MESSAGE, 1);
+        if (n < 0) {
             return (void*)-1;
         }
-
-        printf("Forwarding message to group\n");
-        Group* grp = find_group_by_id(msg.dst);
-        send_group_message(grp, msg);
+        route_group_batch(batch, n);
     }
 }
 
 void* 
 handle_client_send_msgs() {
+    static Message batch[BATCH_SIZE];
     while (1) {
-        Message msg;
-        int size = sizeof(msg) - sizeof(msg.mtype);
-        int status = msgrcv(server_queue, &msg, size, CLIENT_MESSAGE, 0);
-        if (status < 0) {
-            perror("msgrcv");
+        int n = receive_batch(batch, CLIENT_MESSAGE, 1);
+        if (n < 0) {
             return (void*)-1;
         }
-
-        Client* clt = find_client_by_id(msg.dst);
-        send_client_message(clt, msg);
+        route_client_batch(batch, n);
     }
 }
 
@@ -319,81 +1422,215 @@ get_all_groups_msg() {
     return result;
 }
 
+// Appends a response to the list of responses of a query
+QueryResponse*
+add_query_response(QueryResponse* responses, int* num_responses, int* max_responses, QueryResponse res) {
+    if (*num_responses == *max_responses) {
+        responses = grow_array(responses, max_responses, sizeof(QueryResponse));
+    }
+    responses[(*num_responses)++] = res;
+
+    return responses;
+}
+
+void
+answer_query(QueryRequest* query) {
+    static QueryResponse* responses = NULL;
+    static int max_responses = 0;
+
+    printf("Received query. Finding src client\n");
+
+    // The responses are put together under the lock and sent after it
+    int num_responses = 0;
+    pthread_rwlock_rdlock(&directory_lock);
+    Client* src_client = find_client_by_id(query->src);
+    if (src_client == NULL) {
+        pthread_rwlock_unlock(&directory_lock);
+        printf("No client with cid = %d\n", query->src);
+        return;
+    }
+    QueryResponse res;
+    res.mtype = QUERY_RESPONSE;
+    res.content[0] = '\0';
+
+    printf("Found client %s\n", src_client->name);
+
+    switch (query->query_type) {
+    case QUERY_CLIENT:
+        if (strcmp(query->content, "_ALL_") != 0) {
+            Client* clt = find_client_by_name(query->content);
+            if (clt == NULL) {
+                res.status = STATUS_ERROR;
+                break;
+            }
+            sprintf(res.content, "%d", clt->cid);
+            res.status = STATUS_OK;
+        } 
+        else {
+            for (int i = 0; i < total_clients; i++) {
+                Client* clt = clients[i];
+                sprintf(res.content, "name = %s | cid = %d", clt->name, clt->cid);
+                res.status = STATUS_OK;
+                responses = add_query_response(responses, &num_responses, &max_responses, res);
+            }
+            strcpy(res.content, "_END_");
+        }
+        break;
+
+    case QUERY_GROUP:
+        printf("Group query\n");
+        if (strcmp(query->content, "_ALL_") != 0) {
+            printf("Looking for specific group: %s\n", query->content);
+            Group* grp = find_group_by_name(query->content);
+            if (grp == NULL) {
+                printf("Didn't find a group\n");
+                res.status = STATUS_ERROR;
+                break;
+            }
+            sprintf(res.content, "%d", grp->gid);
+            printf("Found group with gid = %d\n", grp->gid);
+            res.status = STATUS_OK;
+        }
+        else {
+            for (int i = 0; i < total_groups; i++) {
+                Group* grp = groups[i];
+                sprintf(res.content, "name = %s | gid = %d", grp->name, grp->gid);
+                res.status = STATUS_OK;
+                responses = add_query_response(responses, &num_responses, &max_responses, res);
+            }
+            strcpy(res.content, "_END_");
+        }
+        break;
+    
+    default:
+        sprintf(res.content, "Invalid request!");
+        res.status = STATUS_ERROR;
+        break;
+    }
+    responses = add_query_response(responses, &num_responses, &max_responses, res);
+    pthread_rwlock_unlock(&directory_lock);
+    
+    for (int i = 0; i < num_responses; i++) {
+        send_query_response(src_client, responses[i]);
+    }
+}
+
 void*
 handle_queries() {
     while (1) {
         QueryRequest query;
         int size = sizeof(query) - sizeof(query.mtype);
-        int status = msgrcv(server_queue, &query, size, QUERY_REQUEST, 0);
+        int status = transport_receive(QUERY_REQUEST, &query, size, 1);
         if (status < 0) {
             perror("msgrcv");
             return (void*)-1;
         }
+        answer_query(&query);
+    }
+}
 
-        printf("Received query. Finding src client\n");
-
-        Client* src_client = find_client_by_id(query.src);
-        QueryResponse res;
-        res.mtype = QUERY_RESPONSE;
-
-        printf("Found client %s\n", src_client->name);
-
-        int send_at_end = 1;
-
-        switch (query.query_type) {
-        case QUERY_CLIENT:
-            if (strcmp(query.content, "_ALL_") != 0) {
-                Client* clt = find_client_by_name(query.content);
-                if (clt == NULL) {
-                    res.status = STATUS_ERROR;
-                    break;
-                }
-                sprintf(res.content, "%d", clt->cid);
-                res.status = STATUS_OK;
-            } 
-            else {
-                for (int i = 0; i < total_clients; i++) {
-                    Client* clt = clients[i];
-                    sprintf(res.content, "name = %s | cid = %d", clt->name, clt->cid);
-                    res.status = STATUS_OK;
-                    send_query_response(src_client, res);
-                }
-                strcpy(res.content, "_END_");
-            }
+void
+apply_control(ControlMessage* cmsg) {
+    // printf("whoopty\n");
+
+    ControlResponse cres;
+    cres.mtype = CONTROL_RESPONSE;
+    cres.action = cmsg->action;
+
+    pthread_rwlock_wrlock(&directory_lock);
+    switch (cmsg->action) {
+    case REGISTER_CLIENT: {
+        printf("Register client message received\n");
+        Client* clt = register_client(cmsg->src, cmsg->name, cmsg->queuepath);
+        printf("Client registered\n");
+        cres.status = STATUS_OK;
+        break;
+    }
+    
+    case JOIN_GROUP: {
+        printf("Finding client\n");
+        Client* clt = find_client_by_id(cmsg->src);
+        printf("Finding group\n");
+        Group* grp = find_group_by_id(cmsg->gid);
+        if (clt == NULL || grp == NULL) {
+            cres.status = STATUS_ERROR;
             break;
+        }
+        printf("Joining group %s\n", grp->name);
+        int members = grp->num_clients;
+        join_group(grp, clt);
+        printf("Joined group\n");
+        cres.status = STATUS_OK;
+        if (grp->num_clients > members) {
+            save_directory("member\t%d\t%d\n", grp->gid, clt->cid);
+        }
+        break;
+    }
 
-        case QUERY_GROUP:
-            printf("Group query\n");
-            if (strcmp(query.content, "_ALL_") != 0) {
-                printf("Looking for specific group: %s\n", query.content);
-                Group* grp = find_group_by_name(query.content);
-                if (grp == NULL) {
-                    printf("Didn't find a group\n");
-                    res.status = STATUS_ERROR;
-                    break;
-                }
-                sprintf(res.content, "%d", grp->gid);
-                printf("Found group with gid = %d\n", grp->gid);
-                res.status = STATUS_OK;
-            }
-            else {
-                for (int i = 0; i < total_groups; i++) {
-                    Group* grp = groups[i];
-                    sprintf(res.content, "name = %s | gid = %d", grp->name, grp->gid);
-                    res.status = STATUS_OK;
-                    send_query_response(src_client, res);
-                }
-                strcpy(res.content, "_END_");
-            }
+    case CREATE_GROUP:{
+        printf("Finding client\n");
+        Client* clt = find_client_by_id(cmsg->src);
+        if (clt == NULL || find_group_by_name(cmsg->name) != NULL) {
+            cres.status = STATUS_ERROR;
             break;
-        
-        default:
-            sprintf(res.content, "Invalid request!");
-            res.status = STATUS_ERROR;
+        }
+        printf("Found client\n");
+        printf("Creating group\n");
+        Group* grp = create_group(cmsg->name, clt);
+        printf("Created group\n");
+        cres.status = STATUS_OK;
+        cres.gid = grp->gid;
+        save_directory("group\t%d\t%s\nmember\t%d\t%d\n", grp->gid, grp->name, grp->gid, clt->cid);
+        printf("Everything good\n");
+        break;
+    }
+
+    case READER_ONLINE:
+    case READER_OFFLINE: {
+        Client* clt = find_client_by_id(cmsg->src);
+        if (clt == NULL) {
+            cres.status = STATUS_ERROR;
             break;
         }
-        
-        send_query_response(src_client, res);
+        pthread_mutex_lock(&outbound_lock);
+        cres.status = STATUS_OK;
+        if (cmsg->action == READER_ONLINE) {
+            if (set_reading(clt, cmsg->reading, 1) < 0) {
+                cres.status = STATUS_ERROR;
+            }
+        }
+        else {
+            set_reading(clt, cmsg->reading, -1);
+        }
+        printf("%s reads %d conversations, %d messages waiting\n", clt->name, clt->num_reading, clt->outbound_len);
+        pthread_mutex_unlock(&outbound_lock);
+        break;
+    }
+
+    default:
+        cres.status = STATUS_ERROR;
+        break;
+    }
+
+    Client* src_clt = find_client_by_id(cmsg->src);
+    pthread_rwlock_unlock(&directory_lock);
+    if (src_clt == NULL) {
+        printf("No client with cid = %d\n", cmsg->src);
+        return;
+    }
+    if (cmsg->action == READER_OFFLINE) {
+        return; // the reader is gone, nobody waits for the response
+    }
+    printf("Sending response to %s\n", src_clt->name);
+    send_control_response(src_clt, cres);
+    printf("Sent response\n");
+
+    // the held messages go after the response, the reader waits for it
+    // and they could fill its queue
+    if (cmsg->action == READER_ONLINE) {
+        pthread_mutex_lock(&outbound_lock);
+        flush_outbound(src_clt);
+        pthread_mutex_unlock(&outbound_lock);
     }
 }
 
@@ -403,88 +1640,127 @@ handle_control_msgs() {
     while (1) {
         ControlMessage cmsg;
         int size = sizeof(cmsg) - sizeof(cmsg.mtype);
-        // printf("Expecting size=%d\n", size);
-        int status = msgrcv(server_queue, (void*)&cmsg, size, CONTROL, 0);
+        int status = transport_receive(CONTROL, &cmsg, size, 1);
         if (status < 0) {
             perror("msgrcv");
             return (void*)-1;
         }
+        apply_control(&cmsg);
+    }
+}
 
-        // printf("whoopty\n");
-
-        ControlResponse cres;
-        cres.mtype = CONTROL_RESPONSE;
-        cres.action = cmsg.action;
+// Serves every type of message and the timers from one thread, for a
+// transport that can be polled. Whenever several types are ready they are
+// served in a fixed order, control first, then queries, group and client
+// messages and the timers, each a batch at a time so that none starves
+// the others.
+int
+run_event_loop() {
+    static Message batch[BATCH_SIZE];
+    long types[] = { CONTROL, QUERY_REQUEST, GROUP_MESSAGE, CLIENT_MESSAGE };
+    int num_types = sizeof(types) / sizeof(types[0]);
+
+    int epfd = epoll_create1(0);
+    int timer = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (epfd < 0 || timer < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct itimerspec tick = { { 0, FLUSH_INTERVAL_MS * 1000000 }, { 0, FLUSH_INTERVAL_MS * 1000000 } };
+    timerfd_settime(timer, 0, &tick, NULL);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    for (int i = 0; i <= num_types; i++) {
+        ev.data.u32 = i; // num_types is the timer
+        int fd = i < num_types ? transport_fd(types[i]) : timer;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
 
-        switch (cmsg.action) {
-        case REGISTER_CLIENT: {
-            printf("Register client message received\n");
-            Client* clt = register_client(cmsg.src, cmsg.name, cmsg.queuepath);
-            printf("Client registered\n");
-            cres.status = STATUS_OK;
-            break;
+    printf("Serving all messages from one event loop\n");
+    while (1) {
+        struct epoll_event events[8];
+        int n = epoll_wait(epfd, events, 8, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return -1;
         }
-        
-        case JOIN_GROUP: {
-            printf("Finding client\n");
-            Client* clt = find_client_by_id(cmsg.src);
-            printf("Finding group\n");
-            Group* grp = find_group_by_id(cmsg.gid);
-            printf("Joining group %s\n", grp->name);
-            join_group(grp, clt);
-            printf("Joined group\n");
-            cres.status = STATUS_OK;
-            break;
+        int ready[8] = { 0 };
+        for (int i = 0; i < n; i++) {
+            ready[events[i].data.u32] = 1;
         }
 
-        case CREATE_GROUP:{
-            printf("Finding client\n");
-            Client* clt = find_client_by_id(cmsg.src);
-            printf("Found client\n");
-            printf("Creating group\n");
-            Group* grp = create_group(cmsg.name, clt);
-            printf("Created group\n");
-            cres.status = STATUS_OK;
-            cres.gid = grp->gid;
-            printf("Everything good\n");
-            break;
+        if (ready[0]) {
+            for (int i = 0; i < BATCH_SIZE; i++) {
+                ControlMessage cmsg;
+                if (transport_receive(CONTROL, &cmsg, sizeof(cmsg) - sizeof(cmsg.mtype), 0) < 0) break;
+                apply_control(&cmsg);
+            }
         }
-
-        default:
-            cres.status = STATUS_ERROR;
-            break;
+        if (ready[1]) {
+            for (int i = 0; i < BATCH_SIZE; i++) {
+                QueryRequest query;
+                if (transport_receive(QUERY_REQUEST, &query, sizeof(query) - sizeof(query.mtype), 0) < 0) break;
+                answer_query(&query);
+            }
+        }
+        if (ready[2]) {
+            int count = receive_batch(batch, GROUP_MESSAGE, 0);
+            if (count > 0) route_group_batch(batch, count);
+        }
+        if (ready[3]) {
+            int count = receive_batch(batch, CLIENT_MESSAGE, 0);
+            if (count > 0) route_client_batch(batch, count);
+        }
+        if (ready[num_types]) {
+            unsigned long long expirations;
+            read(timer, &expirations, sizeof(expirations));
+            tick_timers();
         }
-
-        Client* src_clt = find_client_by_id(cmsg.src);
-        printf("Sending response to %s\n", src_clt->name);
-        send_control_response(src_clt, cres);
-        printf("Sent response\n");
     }
 }
 
 int
-main() {
+main(int argc, char** argv) {
     init_dirs();
-    key_t key = ftok("/tmp/simplemsg/server.queue", 1);
-    server_queue = msgget(key, 0777 | IPC_CREAT);
-    if (server_queue < 0) {
+    int kind = argc > 1 && strcmp(argv[1], "mq") == 0 ? TRANSPORT_MQ : TRANSPORT_SYSV;
+    if (transport_listen(kind) < 0) {
         printf("Failed to create server queue!\n");
-        perror("msgget");
         exit(-1);
     }
+    if (init_ring() < 0) {
+        printf("Failed to create the message ring, group messages are copied to every member\n");
+    }
+
+    wheel_now = time(NULL);
+    if (init_log() < 0) {
+        printf("Failed to open the message log, undelivered messages are lost on restart\n");
+    }
+    load_directory();
+
+    if (transport == TRANSPORT_MQ) {
+        return run_event_loop();
+    }
 
+    // SysV queues cannot be polled, a thread blocks on each type
     printf("Connected to queue.\nStarting handlers...\n");
-    pthread_t grp_send, clt_send, control, query;
+    pthread_t grp_send, clt_send, control, query, timers;
 
     pthread_create(&grp_send, NULL, handle_group_send_msgs, NULL);
     pthread_create(&clt_send, NULL, handle_client_send_msgs, NULL);
     pthread_create(&control, NULL, handle_control_msgs, NULL);
     pthread_create(&query, NULL, handle_queries, NULL);
+    pthread_create(&timers, NULL, handle_timers, NULL);
     
     pthread_join(grp_send, NULL);
     pthread_join(clt_send, NULL);
     pthread_join(control, NULL);
     pthread_join(query, NULL);
+    pthread_join(timers, NULL);
 
     return 0;
 }
\ No newline at end of file
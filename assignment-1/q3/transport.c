@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <mqueue.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+
+#include "message.h"
+#include "transport.h"
+
+int transport = TRANSPORT_SYSV;
+int sysv_queue = -1;
+mqd_t mqueues[4] = { -1, -1, -1, -1 };
+char* mq_names[4] = { MQ_CONTROL, MQ_QUERY, MQ_GROUP, MQ_CLIENT };
+
+// Index of the POSIX queue of the type, -1 for types not sent to the server
+int
+mq_index(long type) {
+    switch (type) {
+    case CONTROL: return 0;
+    case QUERY_REQUEST: return 1;
+    case GROUP_MESSAGE: return 2;
+    case CLIENT_MESSAGE: return 3;
+    default: return -1;
+    }
+}
+
+int
+open_sysv() {
+    key_t key = ftok("/tmp/simplemsg/server.queue", 1);
+    sysv_queue = msgget(key, 0777 | IPC_CREAT);
+    if (sysv_queue < 0) {
+        perror("msgget");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+transport_listen(int kind) {
+    transport = kind;
+    if (kind == TRANSPORT_SYSV) {
+        // clients look for the POSIX queues first, remove those of an
+        // earlier run
+        for (int i = 0; i < 4; i++) {
+            mq_unlink(mq_names[i]);
+        }
+        return open_sysv();
+    }
+
+    struct mq_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.mq_maxmsg = MQ_MAX_MSGS;
+    attr.mq_msgsize = MQ_MSG_SIZE;
+    for (int i = 0; i < 4; i++) {
+        mq_unlink(mq_names[i]);
+        mqueues[i] = mq_open(mq_names[i], O_RDONLY | O_CREAT | O_NONBLOCK, 0666, &attr);
+        if (mqueues[i] < 0) {
+            perror("mq_open");
+            return -1;
+        }
+        fchmod(mqueues[i], 0666); // clients of every user send to it
+    }
+
+    return 0;
+}
+
+int
+transport_connect() {
+    for (int i = 0; i < 4; i++) {
+        mqueues[i] = mq_open(mq_names[i], O_WRONLY);
+        if (mqueues[i] < 0) {
+            break;
+        }
+    }
+    if (mqueues[3] >= 0) {
+        transport = TRANSPORT_MQ;
+        return 0;
+    }
+
+    transport = TRANSPORT_SYSV;
+    return open_sysv();
+}
+
+int
+transport_send(void* msg, int size) {
+    if (transport == TRANSPORT_SYSV) {
+        return msgsnd(sysv_queue, msg, size, 0);
+    }
+
+    int i = mq_index(*(long*)msg);
+    if (i < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return mq_send(mqueues[i], msg, size + sizeof(long), 0);
+}
+
+int
+transport_receive(long type, void* msg, int size, int wait) {
+    if (transport == TRANSPORT_SYSV) {
+        return msgrcv(sysv_queue, msg, size, type, wait ? 0 : IPC_NOWAIT);
+    }
+
+    int i = mq_index(type);
+    if (i < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    char buf[MQ_MSG_SIZE];
+    while (1) {
+        int status = mq_receive(mqueues[i], buf, sizeof(buf), NULL);
+        if (status >= 0) {
+            int len = status < size + (int)sizeof(long) ? status : size + (int)sizeof(long);
+            memcpy(msg, buf, len);
+            return len - sizeof(long);
+        }
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        if (!wait) {
+            errno = ENOMSG;
+            return -1;
+        }
+        struct pollfd pfd = { mqueues[i], POLLIN, 0 };
+        poll(&pfd, 1, -1);
+    }
+}
+
+int
+transport_fd(long type) {
+    int i = mq_index(type);
+    if (transport == TRANSPORT_SYSV || i < 0) {
+        return -1;
+    }
+
+    return mqueues[i];
+}
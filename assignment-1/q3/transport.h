@@ -0,0 +1,38 @@
+#include <stddef.h>
+
+// Transport of the messages clients send to the server. SysV message
+// queues are the default: the server has a single queue and takes each
+// type of message by its mtype, but a SysV queue cannot be polled, so the
+// server blocks a thread per type on it. POSIX message queues are file
+// descriptors on Linux, one queue per type, and the server serves them all
+// from one event loop. Responses and deliveries always go to the SysV
+// queue of the client.
+#define TRANSPORT_SYSV 0
+#define TRANSPORT_MQ 1
+
+#define MQ_CONTROL "/simplemsg.control"
+#define MQ_QUERY "/simplemsg.query"
+#define MQ_GROUP "/simplemsg.group"
+#define MQ_CLIENT "/simplemsg.client"
+#define MQ_MAX_MSGS 10              // the default limit for unprivileged users
+#define MQ_MSG_SIZE sizeof(Message) // the largest message sent to the server
+
+extern int transport;
+
+// Server side: creates the queues of the transport
+int transport_listen(int kind);
+
+// Client side: uses the POSIX queues if the server made them, SysV otherwise
+int transport_connect();
+
+// Same arguments as msgsnd: msg starts with its mtype, which picks the
+// queue, and size does not count it
+int transport_send(void* msg, int size);
+
+// Takes a message of the given type, like msgrcv. Returns its size, or -1
+// with errno ENOMSG if wait is 0 and there is none.
+int transport_receive(long type, void* msg, int size, int wait);
+
+// Descriptor to poll for messages of the given type, -1 if the transport
+// cannot be polled
+int transport_fd(long type);